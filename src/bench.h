@@ -0,0 +1,811 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <cctype>
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+
+#include "mila/scanner.h"
+#include "mila/parser.h"
+#include "mila/printer.h"
+#include "mila/cache.h"
+#include "compiler.h"
+#include "flatcompiler.h"
+#include "jit.h"
+#include "native.h"
+
+namespace mila {
+
+/** Microbenchmarks of the compiler phases.
+
+    Run as mila+ --bench what filename, each benchmark repeats its phase on the given file and prints the throughput of the variants it compares.
+ */
+class Bench {
+public:
+    static void run(std::string const & what, std::string const & filename) {
+        if (what == "scanner")
+            scanner(filename);
+        else if (what == "keywords")
+            keywords(filename);
+        else if (what == "kernels")
+            kernels(filename);
+        else if (what == "codegen")
+            codegen(filename);
+        else if (what == "parser")
+            parser(filename);
+        else if (what == "cache")
+            cache(filename);
+        else if (what == "dispatch")
+            dispatch(filename);
+        else if (what == "printer")
+            printer(filename);
+        else if (what == "shards")
+            shards(filename);
+        else if (what == "aot")
+            aot(filename);
+        else if (what == "recursion")
+            recursion();
+        else
+            throw Exception(STR("Unknown benchmark " << what));
+    }
+
+private:
+
+    /** Returns the average time in seconds of a single execution of the given function.
+
+        The function is repeated until at least the minimal time has elapsed.
+     */
+    template<typename F>
+    static double measure(F f) {
+        typedef std::chrono::steady_clock clock;
+        size_t repetitions = 0;
+        clock::time_point start = clock::now();
+        std::chrono::duration<double> elapsed;
+        do {
+            f();
+            ++repetitions;
+            elapsed = clock::now() - start;
+        } while (elapsed.count() < MIN_TIME or repetitions < MIN_REPETITIONS);
+        return elapsed.count() / repetitions;
+    }
+
+    static void report(char const * what, size_t bytes, double seconds) {
+        std::cout << std::setw(24) << std::left << what
+                  << std::setw(12) << std::right << std::fixed << std::setprecision(2) << (bytes / seconds / (1024 * 1024)) << " MB/s"
+                  << std::setw(12) << std::setprecision(3) << seconds * 1000 << " ms" << std::endl;
+    }
+
+    /** Compares the tokens of two scanners, each of which must have its own context.
+     */
+    static bool sameTokens(Scanner && a, Scanner && b) {
+        while (true) {
+            Token x = a.pop();
+            Token y = b.pop();
+            if (x.type != y.type or x.offset != y.offset or x.line() != y.line() or x.col() != y.col())
+                return false;
+            if (x == Token::Type::number and x.value() != y.value())
+                return false;
+            if (x == Token::Type::ident and (x.symbol().id() != y.symbol().id() or strcmp(x.symbol().name(), y.symbol().name()) != 0))
+                return false;
+            if (x == Token::Type::eof)
+                return true;
+        }
+    }
+
+    /** Scans the whole input of a streaming scanner.
+     */
+    static void drain(Scanner && s) {
+        while (not s.eof())
+            s.pop();
+    }
+
+    /** Compares the std::istream scanner against the memory mapped one, both lexing the whole file upfront and streaming.
+     */
+    static void scanner(std::string const & filename) {
+        size_t bytes = MappedFile::open(filename).size();
+        Context c1, c2, c3, c4, c5, c6;
+        Scanner s1 = Scanner::map(c1, filename);
+        Scanner s2 = Scanner::map(c2, filename, true);
+        std::cout << "scanner: " << filename << ", " << bytes << " bytes, " << s1.size() << " tokens" << std::endl;
+        std::cout << "token memory: " << s1.memory() << " bytes, streaming " << s2.memory() << " bytes" << std::endl;
+        if (not sameTokens(Scanner::file(c3, filename), Scanner::map(c4, filename)) or not sameTokens(Scanner::file(c5, filename), Scanner::map(c6, filename, true)))
+            throw Exception("Scanners produce different tokens");
+        // every measured run is a separate compilation with its own context
+        report("istream", bytes, measure([&] () { Context c; Scanner::file(c, filename); }));
+        report("mmap", bytes, measure([&] () { Context c; Scanner::map(c, filename); }));
+        report("istream streaming", bytes, measure([&] () { Context c; drain(Scanner::file(c, filename, true)); }));
+        report("mmap streaming", bytes, measure([&] () { Context c; drain(Scanner::map(c, filename, true)); }));
+        ThreadPool pool;
+        Context c7, c8;
+        if (not sameTokens(Scanner::map(c7, filename), Scanner::parallel(c8, filename, pool)))
+            throw Exception("Parallel scanner produces different tokens");
+        report(STR("mmap parallel (" << pool.size() << ")").c_str(), bytes, measure([&] () { Context c; Scanner::parallel(c, filename, pool); }));
+    }
+
+    /** Compares the keyword recognition against the std::map lookup it replaced on all words in the file.
+     */
+    static void keywords(std::string const & filename) {
+        static std::map<std::string, Token::Type> const map({
+            { "var", Token::Type::kwVar },
+            { "const", Token::Type::kwConst },
+            { "begin", Token::Type::kwBegin },
+            { "end", Token::Type::kwEnd },
+            { "if", Token::Type::kwIf },
+            { "then", Token::Type::kwThen },
+            { "else", Token::Type::kwElse },
+            { "while", Token::Type::kwWhile },
+            { "do", Token::Type::kwDo },
+            { "write", Token::Type::kwWrite },
+            { "read", Token::Type::kwRead },
+            { "function", Token::Type::kwFunction },
+            { "return", Token::Type::kwReturn },
+        });
+        MappedFile f = MappedFile::open(filename);
+        std::vector<std::pair<char const *, size_t>> words;
+        size_t bytes = 0;
+        for (char const * i = f.begin(), * e = f.end(); i != e; ) {
+            if (not isalpha(*i)) {
+                ++i;
+                continue;
+            }
+            char const * start = i;
+            while (i != e and isalnum(*i))
+                ++i;
+            words.push_back(std::make_pair(start, i - start));
+            bytes += i - start;
+        }
+        size_t kws = 0;
+        for (auto const & w : words) {
+            auto i = map.find(std::string(w.first, w.second));
+            Token::Type t = i == map.end() ? Token::Type::ident : i->second;
+            if (Token::keyword(w.first, w.second) != t)
+                throw Exception(STR("Keyword mismatch for " << std::string(w.first, w.second)));
+            if (t != Token::Type::ident)
+                ++kws;
+        }
+        std::cout << "keywords: " << filename << ", " << words.size() << " words, " << kws << " keywords" << std::endl;
+        volatile size_t sink = 0;
+        report("std::map", bytes, measure([&] () {
+            for (auto const & w : words)
+                sink += map.find(std::string(w.first, w.second)) != map.end();
+        }));
+        report("switch", bytes, measure([&] () {
+            for (auto const & w : words)
+                sink += Token::keyword(w.first, w.second) != Token::Type::ident;
+        }));
+    }
+
+    /** Walks the whole buffer using the given kernels, skipping whitespace, comments and words, and returns the number of items skipped.
+     */
+    template<typename WHITESPACE, typename COMMENT, typename IDENTIFIER>
+    static size_t walk(MappedFile const & f, WHITESPACE skipWhitespace, COMMENT findCommentEnd, IDENTIFIER findIdentifierEnd) {
+        size_t items = 0;
+        char const * p = f.begin();
+        while (p != f.end()) {
+            p = skipWhitespace(p, f.end());
+            if (p == f.end())
+                break;
+            if (*p == '{')
+                p = findCommentEnd(p + 1, f.end());
+            else if (simd::isAlnum(*p))
+                p = findIdentifierEnd(p, f.end());
+            if (p != f.end())
+                ++p;
+            ++items;
+        }
+        return items;
+    }
+
+    /** Compares the scalar scanning kernels with the vectorized ones.
+     */
+    static void kernels(std::string const & filename) {
+        MappedFile f = MappedFile::open(filename);
+        size_t items = walk(f, simd::scalar::skipWhitespace, simd::scalar::findCommentEnd, simd::scalar::findIdentifierEnd);
+        if (walk(f, simd::skipWhitespace, simd::findCommentEnd, simd::findIdentifierEnd) != items)
+            throw Exception("Kernels skip different number of items");
+        std::cout << "kernels: " << filename << ", " << f.size() << " bytes, " << items << " items, vector width " << MILA_SIMD_WIDTH << std::endl;
+        volatile size_t sink = 0;
+        report("scalar", f.size(), measure([&] () {
+            sink += walk(f, simd::scalar::skipWhitespace, simd::scalar::findCommentEnd, simd::scalar::findIdentifierEnd);
+        }));
+        report("vector", f.size(), measure([&] () {
+            sink += walk(f, simd::skipWhitespace, simd::findCommentEnd, simd::findIdentifierEnd);
+        }));
+    }
+
+    /** Returns the textual IR of the module of the given function and deletes the module.
+     */
+    static std::string release(llvm::Function * f) {
+        std::string result;
+        llvm::raw_string_ostream s(result);
+        f->getParent()->print(s, nullptr);
+        s.flush();
+        delete f->getParent();
+        return result;
+    }
+
+    /** Compares the pointer linked AST with the flat one on parsing and LLVM code generation.
+
+        The speedup of the flat code generation is reported, so far it has been within noise of 1.
+     */
+    static void codegen(std::string const & filename) {
+        size_t bytes = MappedFile::open(filename).size();
+        Context c1, c2;
+        ast::Module * m = Parser::parse(Scanner::map(c1, filename));
+        std::unique_ptr<flat::Tree> t(FlatParser::parse(Scanner::map(c2, filename)));
+        std::stringstream p1, p2;
+        ast::Printer::print(m, p1);
+        flat::Printer::print(*t, p2);
+        if (p1.str() != p2.str())
+            throw Exception("Flat AST prints differently");
+        std::stringstream p3;
+        ast::IterativePrinter::print(m, p3);
+        if (p1.str() != p3.str())
+            throw Exception("Iterative printer prints differently");
+        std::string ir = release(Compiler::compile(m));
+        if (ir != release(FlatCompiler::compile(*t)))
+            throw Exception("Flat AST compiles to different code");
+        if (ir != release(IterativeCompiler::compile(m)))
+            throw Exception("Iterative compiler produces different code");
+        std::cout << "codegen: " << filename << ", " << bytes << " bytes, " << t->size() << " nodes" << std::endl;
+        std::cout << "ast memory: " << c1.nodes.bytes() << " bytes, flat " << t->bytes() << " bytes" << std::endl;
+        report("parse", bytes, measure([&] () { Context c; Parser::parse(Scanner::map(c, filename)); }));
+        report("parse flat", bytes, measure([&] () { Context c; delete FlatParser::parse(Scanner::map(c, filename)); }));
+        double seconds = measure([&] () { delete Compiler::compile(m)->getParent(); });
+        double flatSeconds = measure([&] () { delete FlatCompiler::compile(*t)->getParent(); });
+        report("codegen", bytes, seconds);
+        report("codegen flat", bytes, flatSeconds);
+        std::cout << "codegen flat speedup: " << std::setprecision(2) << seconds / flatSeconds << "x" << std::endl;
+        report("codegen iterative", bytes, measure([&] () { delete IterativeCompiler::compile(m)->getParent(); }));
+        report("print", bytes, measure([&] () { std::stringstream s; ast::Printer::print(m, s); }));
+        report("print flat", bytes, measure([&] () { std::stringstream s; flat::Printer::print(*t, s); }));
+        report("print iterative", bytes, measure([&] () { std::stringstream s; ast::IterativePrinter::print(m, s); }));
+    }
+
+    /** Appends random expression of at most the given depth to the stream.
+
+        Uses its own linear congruential generator so that the generated programs are the same everywhere.
+     */
+    static void expression(std::ostream & s, uint32_t & seed, int depth) {
+        static char const * const ops[] = { " + ", " - ", " * ", " / ", " < ", " > ", " <= ", " >= ", " = ", " <> " };
+        seed = seed * 1103515245 + 12345;
+        uint32_t r = seed >> 16;
+        if (depth == 0 or r % 5 == 0) {
+            switch (r % 4) {
+                case 0:
+                    s << (r % 1000);
+                    break;
+                case 1:
+                    s << static_cast<char>('a' + r % 3);
+                    break;
+                case 2:
+                    s << "-";
+                    expression(s, seed, 0);
+                    break;
+                default:
+                    s << "(";
+                    expression(s, seed, depth == 0 ? 0 : depth - 1);
+                    s << ")";
+            }
+        } else {
+            expression(s, seed, depth - 1);
+            s << ops[r % 10];
+            expression(s, seed, depth - 1);
+        }
+    }
+
+    /** Returns a program of the given number of assignments of random expressions.
+     */
+    static std::string expressions(size_t statements) {
+        std::stringstream s;
+        uint32_t seed = 1;
+        s << "begin" << std::endl << "    var a, b, c" << std::endl;
+        for (size_t i = 0; i < statements; ++i) {
+            s << "    " << static_cast<char>('a' + i % 3) << " := ";
+            expression(s, seed, 6);
+            s << std::endl;
+        }
+        s << "end" << std::endl;
+        return s.str();
+    }
+
+    /** Times the parsing of the given program, excluding the scanning, optionally with functions parsed in parallel on the pool, or on the explicit stacks.
+     */
+    static void parse(char const * what, std::string const & text, ThreadPool * pool = nullptr, bool iterative = false) {
+        Context c;
+        size_t tokens = Scanner::text(c, text).size();
+        double seconds = measure([&] () {
+            Context c;
+            Scanner s = Scanner::text(c, text);
+            Parser::parse(s, pool, iterative);
+        }) - measure([&] () {
+            Context c;
+            Scanner::text(c, text);
+        });
+        report(what, text.size(), seconds);
+        std::cout << std::setw(24) << "" << std::setw(12) << std::right << std::setprecision(2) << seconds * 1e9 / tokens << " ns/token" << std::endl;
+    }
+
+    /** Times the parser on the given file and on generated expression heavy program, the iterative parser, and the parallel parsing of the file's functions.
+     */
+    static void parser(std::string const & filename) {
+        MappedFile f = MappedFile::open(filename);
+        std::string file(f.begin(), f.end());
+        std::string generated = expressions(20000);
+        std::cout << "parser: " << filename << ", " << file.size() << " bytes; expressions, " << generated.size() << " bytes" << std::endl;
+        parse("file", file);
+        parse("expressions", generated);
+        parse("file iterative", file, nullptr, true);
+        parse("expressions iterative", generated, nullptr, true);
+        ThreadPool pool;
+        Context c1, c2, c3;
+        std::stringstream p1, p2, p3;
+        ast::Printer::print(Parser::parse(Scanner::text(c1, file)), p1);
+        ast::Printer::print(Parser::parse(Scanner::text(c2, file), &pool), p2);
+        if (p1.str() != p2.str())
+            throw Exception("Parallel parser produces different AST");
+        ast::Printer::print(Parser::parse(Scanner::text(c3, file), nullptr, true), p3);
+        if (p1.str() != p3.str())
+            throw Exception("Iterative parser produces different AST");
+        parse(STR("file parallel (" << pool.size() << ")").c_str(), file, &pool);
+    }
+
+    /** Compares loading of the AST from the cache with scanning and parsing the file.
+
+        The cache lives in a temporary directory, which is removed afterwards.
+     */
+    static void cache(std::string const & filename) {
+        size_t bytes = MappedFile::open(filename).size();
+        char dir[] = "/tmp/mila-cache-XXXXXX";
+        if (mkdtemp(dir) == nullptr)
+            throw Exception("Unable to create temporary directory");
+        AstCache cache(dir);
+        {
+            Context c1, c2;
+            if (cache.load(c1, filename) != nullptr)
+                throw Exception("Fresh cache should not have the file");
+            std::unique_ptr<flat::Tree> t(FlatParser::parse(Scanner::map(c1, filename)));
+            cache.store(*t);
+            std::unique_ptr<flat::Tree> cached(cache.load(c2, filename));
+            if (cached == nullptr)
+                throw Exception("Stored AST not found in the cache");
+            Context c3;
+            std::stringstream p1, p2, p3;
+            flat::Printer::print(*t, p1);
+            flat::Printer::print(*cached, p2);
+            ast::Printer::print(AstCache::expand(*cached), p3);
+            if (p1.str() != p2.str() or p1.str() != p3.str())
+                throw Exception("Cached AST differs from the parsed one");
+        }
+        std::cout << "cache: " << filename << ", " << bytes << " bytes, cache file " << cache.path() << ", " << cache.bytes() << " bytes" << std::endl;
+        report("scan + parse", bytes, measure([&] () { Context c; Parser::parse(Scanner::map(c, filename)); }));
+        report("scan + parse flat", bytes, measure([&] () { Context c; delete FlatParser::parse(Scanner::map(c, filename)); }));
+        report("cache load flat", bytes, measure([&] () { Context c; delete cache.load(c, filename); }));
+        report("cache load + expand", bytes, measure([&] () {
+            Context c;
+            std::unique_ptr<flat::Tree> t(cache.load(c, filename));
+            AstCache::expand(*t);
+        }));
+        remove(cache.path().c_str());
+        rmdir(dir);
+    }
+
+    /** Walks the whole AST with virtual double dispatch, summing the numbers and counting the nodes.
+     */
+    class VirtualWalker : public ast::Visitor {
+    public:
+        size_t nodes = 0;
+        int64_t sum = 0;
+
+        void walk(ast::Node * n) {
+            n->accept(this);
+        }
+
+    protected:
+        void visit(ast::Node * n) override {
+            ++nodes;
+        }
+
+        void visit(ast::Declaration * d) override {
+            ++nodes;
+            if (d->value != nullptr)
+                d->value->accept(this);
+        }
+
+        void visit(ast::Function * f) override {
+            ++nodes;
+            f->body->accept(this);
+        }
+
+        void visit(ast::Functions * fs) override {
+            ++nodes;
+            for (ast::Function * f : fs->functions)
+                f->accept(this);
+        }
+
+        void visit(ast::Declarations * ds) override {
+            ++nodes;
+            for (ast::Declaration * d : ds->declarations)
+                d->accept(this);
+        }
+
+        void visit(ast::Module * m) override {
+            ++nodes;
+            m->functions->accept(this);
+            m->declarations->accept(this);
+            m->body->accept(this);
+        }
+
+        void visit(ast::Block * b) override {
+            ++nodes;
+            b->declarations->accept(this);
+            for (ast::Node * s : b->statements)
+                s->accept(this);
+        }
+
+        void visit(ast::Write * w) override {
+            ++nodes;
+            w->expression->accept(this);
+        }
+
+        void visit(ast::If * s) override {
+            ++nodes;
+            s->condition->accept(this);
+            s->trueCase->accept(this);
+            s->falseCase->accept(this);
+        }
+
+        void visit(ast::While * s) override {
+            ++nodes;
+            s->condition->accept(this);
+            s->body->accept(this);
+        }
+
+        void visit(ast::Return * r) override {
+            ++nodes;
+            if (r->value != nullptr)
+                r->value->accept(this);
+        }
+
+        void visit(ast::Assignment * a) override {
+            ++nodes;
+            a->value->accept(this);
+        }
+
+        void visit(ast::Call * c) override {
+            ++nodes;
+            for (ast::Expression * a : c->arguments)
+                a->accept(this);
+        }
+
+        void visit(ast::Binary * b) override {
+            ++nodes;
+            b->lhs->accept(this);
+            b->rhs->accept(this);
+        }
+
+        void visit(ast::Unary * u) override {
+            ++nodes;
+            u->operand->accept(this);
+        }
+
+        void visit(ast::Number * n) override {
+            ++nodes;
+            sum += n->value;
+        }
+    };
+
+    /** The same walk as VirtualWalker with static dispatch.
+     */
+    class StaticWalker : public ast::StaticVisitor<StaticWalker> {
+    public:
+        size_t nodes = 0;
+        int64_t sum = 0;
+
+        void walk(ast::Node * n) {
+            dispatch(n);
+        }
+
+    protected:
+        friend class ast::StaticVisitor<StaticWalker>;
+
+        void visit(ast::Node * n) {
+            ++nodes;
+        }
+
+        void visit(ast::Declaration * d) {
+            ++nodes;
+            if (d->value != nullptr)
+                dispatch(d->value);
+        }
+
+        void visit(ast::Function * f) {
+            ++nodes;
+            dispatch(f->body);
+        }
+
+        void visit(ast::Functions * fs) {
+            ++nodes;
+            for (ast::Function * f : fs->functions)
+                dispatch(f);
+        }
+
+        void visit(ast::Declarations * ds) {
+            ++nodes;
+            for (ast::Declaration * d : ds->declarations)
+                dispatch(d);
+        }
+
+        void visit(ast::Module * m) {
+            ++nodes;
+            dispatch(m->functions);
+            dispatch(m->declarations);
+            dispatch(m->body);
+        }
+
+        void visit(ast::Block * b) {
+            ++nodes;
+            dispatch(b->declarations);
+            for (ast::Node * s : b->statements)
+                dispatch(s);
+        }
+
+        void visit(ast::Write * w) {
+            ++nodes;
+            dispatch(w->expression);
+        }
+
+        void visit(ast::If * s) {
+            ++nodes;
+            dispatch(s->condition);
+            dispatch(s->trueCase);
+            dispatch(s->falseCase);
+        }
+
+        void visit(ast::While * s) {
+            ++nodes;
+            dispatch(s->condition);
+            dispatch(s->body);
+        }
+
+        void visit(ast::Return * r) {
+            ++nodes;
+            if (r->value != nullptr)
+                dispatch(r->value);
+        }
+
+        void visit(ast::Assignment * a) {
+            ++nodes;
+            dispatch(a->value);
+        }
+
+        void visit(ast::Call * c) {
+            ++nodes;
+            for (ast::Expression * a : c->arguments)
+                dispatch(a);
+        }
+
+        void visit(ast::Binary * b) {
+            ++nodes;
+            dispatch(b->lhs);
+            dispatch(b->rhs);
+        }
+
+        void visit(ast::Unary * u) {
+            ++nodes;
+            dispatch(u->operand);
+        }
+
+        void visit(ast::Number * n) {
+            ++nodes;
+            sum += n->value;
+        }
+    };
+
+    /** Times walking the AST with the given walker and prints the time per node.
+     */
+    template<typename WALKER>
+    static void walk(char const * what, ast::Module * m, size_t nodes) {
+        volatile int64_t sink = 0;
+        double seconds = measure([&] () {
+            WALKER w;
+            w.walk(m);
+            sink += w.sum;
+        });
+        std::cout << std::setw(24) << std::left << what
+                  << std::setw(12) << std::right << std::fixed << std::setprecision(2) << seconds * 1e9 / nodes << " ns/node"
+                  << std::setw(12) << std::setprecision(3) << seconds * 1000 << " ms" << std::endl;
+    }
+
+    /** Compares the virtual double dispatch of Visitor with StaticVisitor on the given file and on generated expression heavy program by walks over the whole AST.
+     */
+    static void dispatch(std::string const & filename) {
+        MappedFile f = MappedFile::open(filename);
+        dispatch(filename, std::string(f.begin(), f.end()));
+        dispatch("expressions", expressions(20000));
+    }
+
+    static void dispatch(std::string const & what, std::string const & text) {
+        Context c;
+        ast::Module * m = Parser::parse(Scanner::text(c, text));
+        VirtualWalker v;
+        StaticWalker s;
+        v.walk(m);
+        s.walk(m);
+        if (v.nodes != s.nodes or v.sum != s.sum)
+            throw Exception("Static dispatch walks differently");
+        std::cout << "dispatch: " << what << ", " << text.size() << " bytes, " << v.nodes << " nodes" << std::endl;
+        walk<VirtualWalker>("walk virtual", m, v.nodes);
+        walk<StaticWalker>("walk static", m, v.nodes);
+    }
+
+    /** Compares the iostream printer with the buffered one, both writing to /dev/null as --verbose would to the terminal, and rendering into memory only, on the given file and on generated expression heavy program.
+     */
+    static void printer(std::string const & filename) {
+        MappedFile f = MappedFile::open(filename);
+        printer(filename, std::string(f.begin(), f.end()));
+        printer("expressions", expressions(20000));
+    }
+
+    static void printer(std::string const & what, std::string const & text) {
+        Context c;
+        ast::Module * m = Parser::parse(Scanner::text(c, text));
+        std::stringstream expected;
+        ast::Printer::print(m, expected);
+        ast::OutputBuffer buffer;
+        ast::BufferedPrinter::print(m, buffer);
+        if (buffer.str() != expected.str())
+            throw Exception("Buffered printer prints differently");
+        size_t bytes = buffer.size();
+        buffer.clear();
+        ast::BufferedPrinter::print(m, buffer, true);
+        size_t compactBytes = buffer.size();
+        std::cout << "printer: " << what << ", " << bytes << " bytes printed, " << compactBytes << " compact" << std::endl;
+        std::ofstream null("/dev/null");
+        report("print iostream", bytes, measure([&] () { ast::Printer::print(m, null); null.flush(); }));
+        report("print buffered", bytes, measure([&] () { ast::BufferedPrinter::print(m, null); }));
+        report("print compact", compactBytes, measure([&] () { ast::BufferedPrinter::print(m, null, true); }));
+        report("render stringstream", bytes, measure([&] () { std::stringstream s; ast::Printer::print(m, s); }));
+        report("render buffer", bytes, measure([&] () { buffer.clear(); ast::BufferedPrinter::print(m, buffer); }));
+    }
+
+    /** Returns a program of the given number of functions, each calling the previous one, with a random expression in its body.
+     */
+    static std::string functions(size_t count) {
+        std::stringstream s;
+        uint32_t seed = 1;
+        for (size_t i = 0; i < count; ++i) {
+            s << "function f" << i << "(a, b) begin" << std::endl << "    var c" << std::endl;
+            s << "    c := ";
+            expression(s, seed, 6);
+            s << std::endl;
+            s << "    while c > 0 do c := c - b" << std::endl;
+            if (i > 0)
+                s << "    c := c + f" << (i - 1) << "(b, c)" << std::endl;
+            s << "    return c" << std::endl << "end" << std::endl;
+        }
+        s << "begin" << std::endl << "    write f" << (count - 1) << "(1, 2)" << std::endl << "end" << std::endl;
+        return s.str();
+    }
+
+    /** Times the code generation of the given file and of generated program with many functions, compiled serially and in shards on pools of 2 to N threads, N being the number of hardware threads.
+     */
+    static void shards(std::string const & filename) {
+        MappedFile f = MappedFile::open(filename);
+        shards(filename, std::string(f.begin(), f.end()));
+        shards("functions", functions(5000));
+    }
+
+    static void shards(std::string const & what, std::string const & text) {
+        Context c;
+        ast::Module * m = Parser::parse(Scanner::text(c, text));
+        std::cout << "shards: " << what << ", " << text.size() << " bytes, " << m->functions->functions.size() << " functions" << std::endl;
+        report("codegen serial", text.size(), measure([&] () { delete Compiler::compile(m)->getParent(); }));
+        for (unsigned threads = 2, n = std::max(2u, std::thread::hardware_concurrency()); threads <= n; threads *= 2) {
+            ThreadPool pool(threads);
+            report(STR("codegen shards (" << threads << ")").c_str(), text.size(), measure([&] () { delete Compiler::compile(m, pool)->getParent(); }));
+        }
+    }
+
+    /** Returns program summing the squares in a loop of the given number of iterations, so that its running time dominates its startup.
+     */
+    static std::string loop(size_t iterations) {
+        std::stringstream s;
+        s << "var i, s;" << std::endl
+          << "begin" << std::endl
+          << "    i := 0;" << std::endl
+          << "    s := 0;" << std::endl
+          << "    while i < " << iterations << " do" << std::endl
+          << "    begin" << std::endl
+          << "        s := s + i * i;" << std::endl
+          << "        i := i + 1" << std::endl
+          << "    end;" << std::endl
+          << "    write s" << std::endl
+          << "end" << std::endl;
+        return s.str();
+    }
+
+    static void time(char const * what, double seconds) {
+        std::cout << std::setw(24) << std::left << what
+                  << std::setw(27) << std::right << std::fixed << std::setprecision(3) << seconds * 1000 << " ms" << std::endl;
+    }
+
+    /** Compares running the given file and a generated loop with the JIT and as executable compiled ahead of time.
+     */
+    static void aot(std::string const & filename) {
+        MappedFile f = MappedFile::open(filename);
+        aot(filename, std::string(f.begin(), f.end()));
+        aot("loop", loop(50000000));
+    }
+
+    /** The JIT times the code generation and the run of main separately, the executable is timed as a whole process including its startup, with the output of both discarded.
+
+        The program must not read its input.
+     */
+    static void aot(std::string const & what, std::string const & text) {
+        Context c;
+        ast::Module * m = Parser::parse(Scanner::text(c, text));
+        std::cout << "aot: " << what << ", " << text.size() << " bytes" << std::endl;
+        time("jit codegen", measure([&] () { delete JIT::engine(Compiler::compile(m)); }));
+        llvm::Function * main = Compiler::compile(m);
+        std::unique_ptr<llvm::ExecutionEngine> engine(JIT::engine(main));
+        JIT::MainPtr run = reinterpret_cast<JIT::MainPtr>(engine->getPointerToFunction(main));
+        std::stringstream discard;
+        std::streambuf * out = std::cout.rdbuf(discard.rdbuf());
+        double jitRun = measure([&] () { run(); discard.str(""); });
+        std::cout.rdbuf(out);
+        time("jit run", jitRun);
+        time("aot object", measure([&] () {
+            llvm::Function * main = Compiler::compile(m);
+            llvm::SmallVector<char, 4096> buffer;
+            llvm::raw_svector_ostream o(buffer);
+            Native::object(main->getParent(), o);
+            delete main->getParent();
+        }));
+        llvm::SmallString<128> path;
+        llvm::sys::fs::createTemporaryFile("mila-aot", "", path);
+        std::string exe = path.str().str();
+        main = Compiler::compile(m);
+        time("aot link", measure([&] () { Native::executable(main->getParent(), exe); }));
+        delete main->getParent();
+        std::string command = STR("'" << exe << "' > /dev/null < /dev/null");
+        time("aot process", measure([&] () {
+            if (std::system(command.c_str()) != 0)
+                throw Exception(STR("Running " << exe << " failed"));
+        }));
+        llvm::sys::fs::remove(exe);
+    }
+
+    /** Times deep recursion, the tail recursive accumulator runs as a loop, while the sum that adds after the call is a real recursion, limited by the native stack.
+     */
+    static void recursion() {
+        recursion("tail", "function sum(n, acc) if n = 0 then return acc else return sum(n - 1, acc + n)", "sum(n, 0)", 10000000);
+        recursion("not tail", "function sum(n) if n = 0 then return 0 else return n + sum(n - 1)", "sum(n)", 100000);
+    }
+
+    static void recursion(char const * what, char const * function, char const * call, size_t depth) {
+        std::string text = STR(function << std::endl << "var n" << std::endl << "begin" << std::endl << "    n := " << depth << std::endl << "    write " << call << std::endl << "end" << std::endl);
+        Context c;
+        llvm::Function * main = Compiler::compile(Parser::parse(Scanner::text(c, text)));
+        std::unique_ptr<llvm::ExecutionEngine> engine(JIT::engine(main));
+        JIT::MainPtr run = reinterpret_cast<JIT::MainPtr>(engine->getPointerToFunction(main));
+        std::stringstream discard;
+        std::streambuf * out = std::cout.rdbuf(discard.rdbuf());
+        double seconds = measure([&] () { run(); discard.str(""); });
+        std::cout.rdbuf(out);
+        std::cout << "recursion: " << what << ", depth " << depth << std::endl;
+        time("run", seconds);
+        std::cout << std::setw(24) << "" << std::setw(12) << std::right << std::setprecision(2) << seconds * 1e9 / depth << " ns/call" << std::endl;
+    }
+
+    static constexpr double MIN_TIME = 0.5;
+    static constexpr size_t MIN_REPETITIONS = 5;
+
+};
+
+}
+
+#endif
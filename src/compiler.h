@@ -1,319 +1,582 @@
 #ifndef COMPILER_H
 #define COMPILER_H
 
+#include <iterator>
+#include <unordered_map>
+#include <unordered_set>
+
 #include "llvm.h"
 
 #include "mila/ast.h"
+#include "mila/threadpool.h"
 
 namespace mila {
 
+/** Compiler error.
+
+    Errors raised at a node only remember the node's source offset, its location is added by the compiler which knows the context of the module.
+ */
 class CompilerError : public Exception {
 public:
     CompilerError(std::string const & what, ast::Node const * ast):
-        Exception(STR(what << " (line: " << ast->line << ", col: " << ast->col << ")")) {
+        Exception(what),
+        located(true),
+        offset(ast->offset) {
+    }
+    CompilerError(std::string const & what, uint32_t offset):
+        Exception(what),
+        located(true),
+        offset(offset) {
+    }
+    CompilerError(std::string const & what, int line, int col):
+        Exception(STR(what << " (line: " << line << ", col: " << col << ")")),
+        located(false),
+        offset(0) {
     }
     CompilerError(std::string const & what):
-        Exception(what) {
+        Exception(what),
+        located(false),
+        offset(0) {
     }
 
+    /** True if the error has an offset whose line and column should be added to the message.
+     */
+    bool const located;
+
+    uint32_t const offset;
 };
 
-/** Compiler */
-class Compiler: public ast::Visitor {
-public:
-    static llvm::Function * compile(ast::Module * module) {
-        Compiler c;
-        module->accept(&c);
+/** LLVM code generation shared by the compilers of the pointer linked (Compiler) and the flat (FlatCompiler) AST.
+
+    The compilers walk their trees and call the emit functions, which create the LLVM IR. Constructs with nested statements take functions that compile the nested parts.
+ */
+class CodeGen {
+protected:
+
+    class Location;
+
+    /** Creates code generator emitting into the given LLVM context, by default the global one.
+
+        Each context may only be used by one thread at a time, code generators running in parallel must each have their own.
+     */
+    CodeGen(llvm::LLVMContext & context = globalContext()):
+        m(nullptr),
+        f(nullptr),
+        bb(nullptr),
+        result(nullptr),
+        availableBB_(nullptr),
+        externalGlobals_(false),
+        reduceStrength_(false),
+        context(context),
+        t_int(llvm::IntegerType::get(context, 32)),
+        t_void(llvm::Type::getVoidTy(context)),
+        t_read(llvm::FunctionType::get(t_int, false)),
+        t_write(llvm::FunctionType::get(t_void, { t_int }, false)),
+        zero(llvm::ConstantInt::get(context, llvm::APInt(32, 0))),
+        one(llvm::ConstantInt::get(context, llvm::APInt(32, 1))) {
+    }
+
+    /** The LLVM context of the modules compiled on the main thread.
+     */
+    static llvm::LLVMContext & globalContext();
+
+    /** Runs the given compilation and checks the module it created.
+
+        Errors are reported with the line and column resolved through the context.
+     */
+    template<typename F>
+    void generate(Context & context, F compile) {
+        try {
+            compile();
+        } catch (CompilerError const & e) {
+            if (not e.located)
+                throw;
+            int line, col;
+            context.lines.resolve(e.offset, line, col);
+            throw CompilerError(e.message, line, col);
+        }
 
         // check that the module's IR is well formed
         llvm::raw_os_ostream err(std::cerr);
-        if (llvm::verifyModule(*c.m, & err)) {
-            c.m->print(llvm::outs(), nullptr);
+        if (llvm::verifyModule(*m, & err)) {
+            m->print(llvm::outs(), nullptr);
             throw CompilerError("Invalid LLVM bitcode produced");
         }
+    }
 
-        // return the main function
-        return c.f;
+    /** Creates the module with the runtime functions and the context for globals.
+     */
+    void emitModule() {
+        result = nullptr;
+        // create the module
+        m = new llvm::Module("mila", context);
+        // add declarations for runtime functions (read and write), first types
+        // then create the functions
+        llvm::Function::Create(t_read, llvm::GlobalValue::ExternalLinkage, "read_", m)->setCallingConv(llvm::CallingConv::C);
+        llvm::Function::Create(t_write, llvm::GlobalValue::ExternalLinkage, "write_", m)->setCallingConv(llvm::CallingConv::C);
+
+        // start the scope of globals
+        openScope();
     }
 
-protected:
-    virtual void visit(ast::Node * n) {
-        throw Exception("Unknown compiler handler");
+    /** Creates the implicit main function and compiles its body.
+     */
+    template<typename F>
+    void emitMain(F body) {
+        emitMainBegin();
+        body();
+        emitFunctionEnd();
     }
 
-    virtual void visit(ast::Expression * d) {
-        throw Exception("Unknown compiler handler");
+    /** Creates the implicit main function, its body is to be compiled next and ended with emitFunctionEnd().
+     */
+    void emitMainBegin() {
+        llvm::FunctionType * ft = llvm::FunctionType::get(t_int, false);
+        f = llvm::Function::Create(ft, llvm::GlobalValue::ExternalLinkage, "main", m);
+        // create the initial basic block for the body
+        bb = llvm::BasicBlock::Create(context, "bb", this->f);
+        beginLocals();
     }
 
-    void compileDeclarations(ast::Declarations * ds, bool isGlobal = false) {
-        for (ast::Declaration * d : ds->declarations) {
-            if (c->hasVariable(d->symbol))
-                throw CompilerError(STR("Redefinition of variable " << d->symbol), d);
-            if (d->value == nullptr) {
-                if (isGlobal) {
-                    auto gv = new llvm::GlobalVariable(*m, t_int, false, llvm::GlobalValue::CommonLinkage, nullptr, d->symbol.name() + "_");
-                    gv->setAlignment(4);
-                    gv->setInitializer(llvm::ConstantInt::get(context, llvm::APInt(32, 0)));
-                    c->variables[d->symbol] = Location::variable(gv);
-                }
-                else
-                    c->variables[d->symbol] = Location::variable(new llvm::AllocaInst(t_int, 0, d->symbol.name(), bb));
-            } else  {
-                d->value->accept(this);
-                c->variables[d->symbol] = Location::constant(result);
-            }
+    void emitVariable(Symbol symbol, uint32_t offset, bool isGlobal) {
+        if (isDeclared(symbol))
+            throw CompilerError(STR("Redefinition of variable " << symbol), offset);
+        if (isGlobal) {
+            auto linkage = externalGlobals_ ? llvm::GlobalValue::ExternalLinkage : llvm::GlobalValue::CommonLinkage;
+            auto gv = new llvm::GlobalVariable(*m, t_int, false, linkage, nullptr, std::string(symbol.name()) + "_");
+            gv->setAlignment(4);
+            if (not externalGlobals_)
+                gv->setInitializer(llvm::ConstantInt::get(context, llvm::APInt(32, 0)));
+            declare(symbol, Location::variable(gv));
         }
+        else
+            declare(symbol, Location::local(newLocal(symbol)));
     }
 
-    virtual void visit(ast::Declaration * d) {
-        throw Exception("This should be unreachable");
+    /** Declares constant with the value in result.
+     */
+    void emitConstant(Symbol symbol, uint32_t offset) {
+        if (isDeclared(symbol))
+            throw CompilerError(STR("Redefinition of variable " << symbol), offset);
+        declare(symbol, Location::constant(result));
     }
 
-    virtual void visit(ast::Function * f) {
+    /** Creates the function and its context, the arguments must be declared next by emitArgument.
+     */
+    void emitFunction(Symbol name, size_t arguments, uint32_t offset) {
         // main is the name of implicit function
-        if (f->name == "main")
-            throw CompilerError("Cannot create user defined main function", f);
+        if (name == "main")
+            throw CompilerError("Cannot create user defined main function", offset);
         // first create the function type
         std::vector<llvm::Type * > at;
-        for (size_t i = 0, e = f->arguments.size(); i != e; ++i)
+        for (size_t i = 0; i != arguments; ++i)
             at.push_back(t_int);
         llvm::FunctionType * ft = llvm::FunctionType::get(t_int, at, false);
         // now create the function
-        if (m->getFunction(f->name.name()) != nullptr)
-            throw CompilerError(STR("Function " << f->name << " already exists"), f);
-        this->f = llvm::Function::Create(ft, llvm::GlobalValue::ExternalLinkage, f->name.name(), m);
+        if (getFunction(name) != nullptr)
+            throw CompilerError(STR("Function " << name << " already exists"), offset);
+        this->f = llvm::Function::Create(ft, llvm::GlobalValue::ExternalLinkage, name.name(), m);
         this->f->setCallingConv(llvm::CallingConv::C);
-        // create the context for the function block
-        c = new BlockContext(c);
+        // open the scope of the arguments
+        openScope();
         // create the initial basic block for the function
         bb = llvm::BasicBlock::Create(context, "bb", this->f);
-        // arguments to the function are in registers, create variables for them 
-        llvm::Function::arg_iterator args = this->f->arg_begin();
-        for (Symbol const & s: f->arguments) {
-            llvm::Value * v = args++;
-            if (c->hasVariable(s))
-                throw CompilerError(STR("Redefinition of variable " << s), f);
-            llvm::AllocaInst * loc = new llvm::AllocaInst(t_int, 0, s.name(), bb);
-            c->variables[s] = Location::variable(loc);
-            new llvm::StoreInst(v, loc, false, bb);
-            // set names, just for debugging purposes
-            v->setName(s.name());
-            loc->setName(s.name());
-        }
-        // compile the body of the function
-        compileFunctionBody(f->body);
-        // unroll the block context
-        BlockContext * x = c;
-        c = c->parent;
-        delete x;
+        beginLocals();
     }
 
-    void compileFunctionBody(ast::Node * node) {
-        // now compile the body
-        node->accept(this);
+    /** Makes a function defined in another module known, unless there already is one of the name.
 
-        // don't insert return statemaent if there is one already 
-        if (bb == nullptr)
-            return;
-        // finally, check if last instruction was not return, and if not emit return 0
-        if (result == nullptr)
-            result = llvm::ReturnInst::Create(context, zero, bb);
-        else if (not llvm::isa<llvm::ReturnInst>(result))
-            result = llvm::ReturnInst::Create(context, result, bb);
+        Its prototype is only added to the module by getFunction() once it is used, so that modules do not declare all functions of the program.
+     */
+    void declareExternal(Symbol name, size_t arguments) {
+        size_t id = name.id();
+        if (id >= externals_.size())
+            externals_.resize(id + 1, -1);
+        if (externals_[id] < 0)
+            externals_[id] = static_cast<int>(arguments);
     }
 
-    virtual void visit(ast::Functions * fs) {
-        for (ast::Function * f : fs->functions)
-            f->accept(this);
+    /** Returns the function of the given name, or nullptr if there is none, adding the prototype of an external function to the module if needed.
+     */
+    llvm::Function * getFunction(Symbol name) {
+        llvm::Function * result = m->getFunction(name.name());
+        size_t id = name.id();
+        if (result != nullptr or id >= externals_.size() or externals_[id] < 0)
+            return result;
+        std::vector<llvm::Type *> at(externals_[id], t_int);
+        llvm::FunctionType * ft = llvm::FunctionType::get(t_int, at, false);
+        result = llvm::Function::Create(ft, llvm::GlobalValue::ExternalLinkage, name.name(), m);
+        result->setCallingConv(llvm::CallingConv::C);
+        return result;
     }
 
-    virtual void visit(ast::Declarations * ds) {
-        compileDeclarations(ds);
+    /** Links the module serialized as bitcode from another context into the module.
+     */
+    void emitLink(std::string const & bitcode) {
+        llvm::Expected<std::unique_ptr<llvm::Module>> other = llvm::parseBitcodeFile(llvm::MemoryBufferRef(bitcode, "shard"), context);
+        if (not other)
+            throw CompilerError(STR("Unable to read module: " << llvm::toString(other.takeError())));
+        if (llvm::Linker::linkModules(*m, std::move(other.get())))
+            throw CompilerError("Unable to link module");
     }
 
-    virtual void visit(ast::Module * module) {
-        result = nullptr;
-        // create the module
-        m = new llvm::Module("mila", context);
-        // add declarations for runtime functions (read and write), first types
-        // then create the functions
-        llvm::Function::Create(t_read, llvm::GlobalValue::ExternalLinkage, "read_", m)->setCallingConv(llvm::CallingConv::C);
-        llvm::Function::Create(t_write, llvm::GlobalValue::ExternalLinkage, "write_", m)->setCallingConv(llvm::CallingConv::C);
+    /** Arguments to the function are in registers, creates variable for the i-th one, whose initial value is the argument.
+     */
+    void emitArgument(size_t i, Symbol s, uint32_t offset) {
+        llvm::Value * v = &*std::next(this->f->arg_begin(), i);
+        if (isDeclared(s))
+            throw CompilerError(STR("Redefinition of variable " << s), offset);
+        int local = newLocal(s);
+        declare(s, Location::local(local));
+        writeLocal(local, bb, v);
+        // set names, just for debugging purposes
+        v->setName(s.name());
+    }
 
-        // start context for globals
-        c = new BlockContext(nullptr); // globals
-        compileDeclarations(module->declarations, true);
-        // compile all functions
-        module->functions->accept(this);
-        // now create main function, and compile the pre-block declarations
-        llvm::FunctionType * ft = llvm::FunctionType::get(t_int, false);
-        f = llvm::Function::Create(ft, llvm::GlobalValue::ExternalLinkage, "main", m);
-        // create the initial basic block and compile the body
-        bb = llvm::BasicBlock::Create(context, "bb", this->f);
-        compileFunctionBody(module->body);
+    /** Ends the function whose body has been compiled.
+     */
+    void emitFunctionEnd() {
+        // don't insert return statemaent if there is one already
+        if (bb != nullptr) {
+            // finally, check if last instruction was not return, and if not emit return 0
+            if (result == nullptr)
+                result = llvm::ReturnInst::Create(context, zero, bb);
+            else if (not llvm::isa<llvm::ReturnInst>(result))
+                result = llvm::ReturnInst::Create(context, result, bb);
+        }
+        // only after the implicit return, which may return a widened comparison
+        removeUnusedWidening();
+        emitTailCalls();
     }
 
-    virtual void visit(ast::Block * d) {
-        // create the context for the function block
-        c = new BlockContext(c);
-        // compile declarations
-        d->declarations->accept(this);
-        // and all statements in the block
-        for (ast::Node * s : d->statements) {
-            if (bb == nullptr)
-                throw CompilerError("Code after return statement is not allowed", s);
-            s->accept(this);
+    /** Marks the calls whose value the function returns as tail calls and turns the tail calls of the function to itself into a loop.
+
+        Calls to a function of the same type are guaranteed tail calls (musttail), others are only marked as tail calls. Both explicit returns and the implicit return of the last value are considered.
+
+        Only a call directly followed by the return of its value is recognized. A call whose value reaches the ret through the if_phi of an if statement that is the last statement (e.g. if c then f(x) else g(x)) is not handled and stays an ordinary call.
+     */
+    void emitTailCalls() {
+        std::vector<llvm::CallInst *> self;
+        for (llvm::BasicBlock & b : *f) {
+            llvm::ReturnInst * ret = llvm::dyn_cast<llvm::ReturnInst>(b.getTerminator());
+            if (ret == nullptr or ret == &b.front())
+                continue;
+            llvm::CallInst * call = llvm::dyn_cast<llvm::CallInst>(ret->getPrevNode());
+            if (call == nullptr or ret->getReturnValue() != call or not call->hasOneUse())
+                continue;
+            llvm::Function * callee = call->getCalledFunction();
+            if (callee == f)
+                self.push_back(call);
+            else if (callee->getFunctionType() == f->getFunctionType() and callee->getCallingConv() == f->getCallingConv())
+                call->setTailCallKind(llvm::CallInst::TCK_MustTail);
+            else
+                call->setTailCall();
         }
-        // unroll the block context
-        BlockContext * x = c;
-        c = c->parent;
-        delete x;
+        if (not self.empty())
+            emitTailRecursion(self);
     }
 
-    virtual void visit(ast::Write * w) {
-        w->expression->accept(this);
+    /** Turns the given calls of the function to itself, each followed by return of its value, into jumps to the start of the function.
+
+        The entry block is split so that the body starts in a loop header, in which phis replace the arguments, with the arguments of the calls as incoming values from the blocks of the calls.
+     */
+    void emitTailRecursion(std::vector<llvm::CallInst *> const & calls) {
+        llvm::BasicBlock * entry = &f->getEntryBlock();
+        llvm::BasicBlock * header = entry->splitBasicBlock(entry->begin(), "tailrecurse");
+        std::vector<llvm::PHINode *> phis;
+        for (llvm::Argument & a : f->args()) {
+            llvm::PHINode * phi = llvm::PHINode::Create(t_int, calls.size() + 1, a.getName(), header->getFirstNonPHI());
+            a.replaceAllUsesWith(phi);
+            phi->addIncoming(&a, entry);
+            phis.push_back(phi);
+        }
+        for (llvm::CallInst * call : calls) {
+            llvm::BasicBlock * b = call->getParent();
+            for (size_t i = 0, e = phis.size(); i != e; ++i)
+                phis[i]->addIncoming(call->getArgOperand(i), b);
+            call->getNextNode()->eraseFromParent();
+            call->eraseFromParent();
+            llvm::BranchInst::Create(header, b);
+        }
+    }
+
+    void openScope() {
+        scopes_.push_back(undo_.size());
+    }
+
+    /** Restores the bindings shadowed by the declarations of the innermost scope.
+     */
+    void closeScope() {
+        for (size_t i = undo_.size(), e = scopes_.back(); i != e; --i)
+            bindings_[undo_[i - 1].first] = undo_[i - 1].second;
+        undo_.resize(scopes_.back());
+        scopes_.pop_back();
+    }
+
+    /** Returns true if the symbol is declared in the innermost scope.
+     */
+    bool isDeclared(Symbol symbol) const {
+        size_t id = symbol.id();
+        return id < bindings_.size() and bindings_[id].scope == scopes_.size();
+    }
+
+    void declare(Symbol symbol, Location const & location) {
+        size_t id = symbol.id();
+        if (id >= bindings_.size())
+            bindings_.resize(id + 1);
+        undo_.push_back(std::make_pair(symbol.id(), bindings_[id]));
+        bindings_[id] = Binding{location, scopes_.size()};
+    }
+
+    Location lookup(Symbol symbol, uint32_t offset) const {
+        size_t id = symbol.id();
+        if (id >= bindings_.size() or bindings_[id].scope == 0)
+            throw CompilerError(STR("Variable or constant " << symbol << " not found"), offset);
+        return bindings_[id].location;
+    }
+
+    /** Checks that a statement does not follow return.
+     */
+    void emitStatement(uint32_t offset) {
+        if (bb == nullptr)
+            throw CompilerError("Code after return statement is not allowed", offset);
+    }
+
+    /** Writes the value in result.
+     */
+    void emitWrite() {
         llvm::CallInst::Create(m->getFunction("write_"), result, "", bb);
         // result of write is the expression it wrote
     }
 
-    virtual void visit(ast::Read * r) {
-        result = llvm::CallInst::Create(m->getFunction("read_"), r->symbol.name(), bb);
-        Location const & l = c->get(r->symbol, r);
+    void emitRead(Symbol symbol, uint32_t offset) {
+        result = llvm::CallInst::Create(m->getFunction("read_"), symbol.name(), bb);
+        Location l = lookup(symbol, offset);
         if (l.isConstant())
-            throw CompilerError(STR("Cannot assign constant " << r->symbol), r);
-        new llvm::StoreInst(result, l.address(), false, bb);
+            throw CompilerError(STR("Cannot assign constant " << symbol), offset);
+        emitStore(l);
         // keep read value in result
     }
 
-    virtual void visit(ast::If * s) {
+    template<typename C, typename T, typename F>
+    void emitIf(C condition, T trueCase, F falseCase) {
+        // compile the condition
+        condition();
+        Branch b = emitIfCondition();
+        trueCase();
+        emitIfTrueCase(b);
+        falseCase();
+        emitIfFalseCase(b);
+    }
+
+    template<typename C, typename B>
+    void emitWhile(C cond, B body) {
+        Loop l = emitWhileBegin();
         // compile the condition
-        s->condition->accept(this);
+        cond();
+        emitWhileCondition(l);
+        body();
+        emitWhileBody(l);
+    }
+
+    /** State of an if statement whose cases are being compiled.
+     */
+    struct Branch {
+        llvm::BasicBlock * trueBB;
+        llvm::BasicBlock * falseBB;
+        llvm::BasicBlock * next;
+        llvm::Value * trueResult;
+    };
+
+    /** Branches on the condition in result, the true case is to be compiled next.
+     */
+    Branch emitIfCondition() {
+        Branch b;
         // create basic blocks for the true & false cases and continuation
-        llvm::BasicBlock * trueCase = llvm::BasicBlock::Create(context, "trueCase", f);
-        llvm::BasicBlock * falseCase = llvm::BasicBlock::Create(context, "falseCase", f);
-        llvm::BasicBlock * next = llvm::BasicBlock::Create(context, "next", f);
+        b.trueBB = llvm::BasicBlock::Create(context, "trueCase", f);
+        b.falseBB = llvm::BasicBlock::Create(context, "falseCase", f);
+        b.next = llvm::BasicBlock::Create(context, "next", f);
 
-        llvm::ICmpInst * cmp = new llvm::ICmpInst(*bb, llvm::ICmpInst::ICMP_NE, result, zero, "if_cond");
-        llvm::BranchInst::Create(trueCase, falseCase, cmp, bb);
+        llvm::BranchInst::Create(b.trueBB, b.falseBB, emitCondition("if_cond"), bb);
+        sealBlock(b.trueBB);
+        sealBlock(b.falseBB);
 
-        bb = trueCase;
-        s->trueCase->accept(this);
-        trueCase = bb;
-        llvm::Value * trueResult = result;
-        if (trueCase != nullptr)
-            llvm::BranchInst::Create(next, bb);
-        bb = falseCase;
-        s->falseCase->accept(this);
-        falseCase = bb;
+        bb = b.trueBB;
+        return b;
+    }
+
+    /** Ends the true case, the false case is to be compiled next.
+     */
+    void emitIfTrueCase(Branch & b) {
+        b.trueBB = bb;
+        b.trueResult = result;
+        if (b.trueBB != nullptr)
+            llvm::BranchInst::Create(b.next, bb);
+        bb = b.falseBB;
+    }
+
+    void emitIfFalseCase(Branch & b) {
+        b.falseBB = bb;
         llvm::Value * falseResult = result;
-        if (falseCase != nullptr)
-            llvm::BranchInst::Create(next, bb);
-        bb = next;
-        if (falseCase == nullptr and trueCase == nullptr) {
-            next->eraseFromParent();
+        if (b.falseBB != nullptr)
+            llvm::BranchInst::Create(b.next, bb);
+        bb = b.next;
+        if (b.falseBB == nullptr and b.trueBB == nullptr) {
+            forgetAvailable();
+            blocks_.erase(b.next);
+            b.next->eraseFromParent();
             result = nullptr;
             bb = nullptr;
         } else {
+            sealBlock(b.next);
             llvm::PHINode * phi = llvm::PHINode::Create(t_int, 2, "if_phi", bb);
-            if (trueCase != nullptr)
-                phi->addIncoming(trueResult, trueCase);
-            if (falseCase != nullptr)
-                phi->addIncoming(falseResult, falseCase);
+            if (b.trueBB != nullptr)
+                phi->addIncoming(b.trueResult, b.trueBB);
+            if (b.falseBB != nullptr)
+                phi->addIncoming(falseResult, b.falseBB);
             result = phi;
         }
     }
 
-    virtual void visit(ast::While * d) {
-        // homework
+    /** State of a while loop being compiled.
+     */
+    struct Loop {
+        llvm::BasicBlock * condition;
+        llvm::BasicBlock * body;
+        llvm::BasicBlock * next;
+        llvm::PHINode * phi;
+    };
 
+    /** Starts the loop, the condition is to be compiled next.
+     */
+    Loop emitWhileBegin() {
+        Loop l;
         // save prev bb
         llvm::Value * prevResult = result;
         llvm::BasicBlock * prevBB = bb;
 
         // create basic blocks for condition, cycle body and continuation
-        llvm::BasicBlock * condition = llvm::BasicBlock::Create(context, "condition", f);
-        llvm::BasicBlock * cycleBody = llvm::BasicBlock::Create(context, "cycleBody", f);
-        llvm::BasicBlock * next = llvm::BasicBlock::Create(context, "next", f);
+        l.condition = llvm::BasicBlock::Create(context, "condition", f);
+        l.body = llvm::BasicBlock::Create(context, "cycleBody", f);
+        l.next = llvm::BasicBlock::Create(context, "next", f);
 
         // jump to condition block
-        llvm::BranchInst::Create(condition, bb);
-        bb = condition;
-
+        llvm::BranchInst::Create(l.condition, bb);
+        bb = l.condition;
 
         // create phi node
-        llvm::PHINode * phi = llvm::PHINode::Create(t_int, 2, "while_phi", bb);
-        phi->addIncoming(prevResult, prevBB);
-
-        // compile the condition
-        d->condition->accept(this);
+        l.phi = llvm::PHINode::Create(t_int, 2, "while_phi", bb);
+        l.phi->addIncoming(prevResult, prevBB);
+        return l;
+    }
 
-        llvm::ICmpInst * cmp = new llvm::ICmpInst(*bb, llvm::ICmpInst::ICMP_NE, result, zero, "while_cond");
-        llvm::BranchInst::Create(cycleBody, next, cmp, bb);
+    /** Branches on the condition in result, the body is to be compiled next.
+     */
+    void emitWhileCondition(Loop & l) {
+        llvm::BranchInst::Create(l.body, l.next, emitCondition("while_cond"), bb);
+        sealBlock(l.body);
+        sealBlock(l.next);
+        bb = l.body;
+    }
 
-        bb = cycleBody;
-        d->body->accept(this);
-        cycleBody = bb;
+    void emitWhileBody(Loop & l) {
+        l.body = bb;
         llvm::Value * trueResult = result;
 
-        if (cycleBody != nullptr) {
-            llvm::BranchInst::Create(condition, bb);
-            phi->addIncoming(trueResult, cycleBody);
+        if (l.body != nullptr) {
+            llvm::BranchInst::Create(l.condition, bb);
+            l.phi->addIncoming(trueResult, l.body);
         } else
-            phi->eraseFromParent();
+            l.phi->eraseFromParent();
+        // all predecessors of the condition are known now
+        sealBlock(l.condition);
 
         result = zero;
-        bb = next;
+        bb = l.next;
     }
 
-    virtual void visit(ast::Return * r) {
-        // homework
-        r->value->accept(this);
+    /** Returns the value in result as condition to branch on.
+
+        Comparisons are widened to integers right after they are emitted, as their use is not known yet. When the comparison is used as a condition, the branch uses it directly instead of comparing its widened value to zero again, and the widening is removed at the end of the function unless something else uses it.
+     */
+    llvm::Value * emitCondition(char const * name) {
+        llvm::SExtInst * widened = llvm::dyn_cast<llvm::SExtInst>(result);
+        if (widened != nullptr and llvm::isa<llvm::ICmpInst>(widened->getOperand(0))) {
+            widened_.push_back(widened);
+            return widened->getOperand(0);
+        }
+        return new llvm::ICmpInst(*bb, llvm::ICmpInst::ICMP_NE, result, zero, name);
+    }
+
+    /** Removes the widenings of the comparisons used as conditions that were not used as values as well.
+     */
+    void removeUnusedWidening() {
+        for (llvm::Value * v : widened_)
+            if (v != nullptr and v->use_empty())
+                llvm::cast<llvm::Instruction>(v)->eraseFromParent();
+        widened_.clear();
+    }
+
+    /** Returns the value in result.
+     */
+    void emitReturn() {
         result = llvm::ReturnInst::Create(context, result, bb);
         if (result == nullptr)
             throw std::exception();
         bb = nullptr;
     }
 
-    virtual void visit(ast::Assignment * a) {
-        a->value->accept(this);
+    /** Stores the value in result to the variable.
+     */
+    void emitAssignment(Symbol symbol, uint32_t offset) {
         // now get the variable and store the value in it
-        Location const & l = c->get(a->symbol, a);
+        Location l = lookup(symbol, offset);
         if (l.isConstant())
-            throw CompilerError(STR("Cannot assign constant " << a->symbol), a);
-        new llvm::StoreInst(result, l.address(), false, bb);
+            throw CompilerError(STR("Cannot assign constant " << symbol), offset);
+        emitStore(l);
         // keep the stored value in result
     }
 
-    virtual void visit(ast::Call * call) {
-        std::vector<llvm::Value * > args;
-        for (ast::Node * a : call->arguments) {
-            a->accept(this);
-            args.push_back(result);
-        }
-        llvm::Function * f = m->getFunction(call->function.name());
+    void emitCall(Symbol function, std::vector<llvm::Value *> const & args, uint32_t offset) {
+        llvm::Function * f = getFunction(function);
         if (f == nullptr)
-            throw CompilerError(STR("Call to undefined function " << call->function), call);
+            throw CompilerError(STR("Call to undefined function " << function), offset);
         if (f->arg_size() != args.size())
-            throw CompilerError(STR("Function " << call->function << " declared with different number of arguments"), call);
-        result = llvm::CallInst::Create(f, args, call->function.name(), bb);
+            throw CompilerError(STR("Function " << function << " declared with different number of arguments"), offset);
+        result = llvm::CallInst::Create(f, args, function.name(), bb);
+        // the called function may change any global
+        available();
+        for (auto i = loads_.begin(); i != loads_.end(); )
+            if (llvm::isa<llvm::GlobalVariable>(i->first))
+                i = loads_.erase(i);
+            else
+                ++i;
     }
 
-    virtual void visit(ast::Binary * op) {
-        // homework
-        op->lhs->accept(this);
-        llvm::Value * lhsValue = result;
-        op->rhs->accept(this);
-
-        switch (op->type) {
+    /** Emits the binary operator on lhsValue and the value in result.
+     */
+    void emitBinary(Token::Type type, llvm::Value * lhsValue) {
+        Operation op{type, lhsValue, result};
+        if (reuse(op))
+            return;
+        switch (type) {
             case Token::Type::opAdd:
                 result = llvm::BinaryOperator::Create(llvm::Instruction::Add, lhsValue, result, "add", bb);
                 break;
             case Token::Type::opSub:
                 result = llvm::BinaryOperator::Create(llvm::Instruction::Sub, lhsValue, result, "sub", bb);
                 break;
-            case Token::Type::opMul:
-                result = llvm::BinaryOperator::Create(llvm::Instruction::Mul, lhsValue, result, "mul", bb);
+            case Token::Type::opMul: {
+                // multiplication by power of two is a shift
+                unsigned shift;
+                if (reduceStrength_ and isPowerOfTwo(result, shift))
+                    result = llvm::BinaryOperator::Create(llvm::Instruction::Shl, lhsValue, llvm::ConstantInt::get(t_int, shift), "shl", bb);
+                else if (reduceStrength_ and isPowerOfTwo(lhsValue, shift))
+                    result = llvm::BinaryOperator::Create(llvm::Instruction::Shl, result, llvm::ConstantInt::get(t_int, shift), "shl", bb);
+                else
+                    result = llvm::BinaryOperator::Create(llvm::Instruction::Mul, lhsValue, result, "mul", bb);
                 break;
+            }
             case Token::Type::opDiv:
                 result = llvm::BinaryOperator::Create(llvm::Instruction::SDiv, lhsValue, result, "sdiv", bb);
                 break;
@@ -344,36 +607,226 @@ protected:
             default:
                 throw Exception("Unknown binary operator token type");
         }
+        operations_[op] = result;
     }
 
-    virtual void visit(ast::Unary * op) {
-        // homework
-        op->operand->accept(this);
+    /** Returns true if the value is a constant power of two greater than one, whose exponent is returned in shift.
 
-        switch (op->type) {
+        Multiplication by one is left to the simplifier, which replaces it by the other operand.
+     */
+    static bool isPowerOfTwo(llvm::Value * value, unsigned & shift) {
+        llvm::ConstantInt * c = llvm::dyn_cast<llvm::ConstantInt>(value);
+        if (c == nullptr or not c->getValue().isPowerOf2())
+            return false;
+        shift = c->getValue().exactLogBase2();
+        return shift > 0;
+    }
+
+    /** Emits the unary operator on the value in result.
+     */
+    void emitUnary(Token::Type type) {
+        switch (type) {
             case Token::Type::opAdd:
                 break;
-            case Token::Type::opSub:
+            case Token::Type::opSub: {
+                Operation op{type, result, nullptr};
+                if (reuse(op))
+                    break;
                 result = llvm::BinaryOperator::Create(llvm::Instruction::Sub, zero, result, "neg", bb);
+                operations_[op] = result;
                 break;
+            }
             default:
                 throw Exception("Unknown unary operator token type");
         }
     }
 
-    virtual void visit(ast::Variable * v) {
-        Location const & l = c->get(v->symbol, v);
-        if (l.isConstant())
+    void emitLoad(Symbol symbol, uint32_t offset) {
+        Location l = lookup(symbol, offset);
+        if (l.isConstant()) {
             result = l.value();
-        else
-            result = new llvm::LoadInst(l.address(), v->symbol, bb);
+            return;
+        }
+        if (l.isLocal()) {
+            result = readLocal(l.local(), bb);
+            return;
+        }
+        available();
+        auto i = loads_.find(l.address());
+        if (i != loads_.end()) {
+            result = i->second;
+        } else {
+            result = new llvm::LoadInst(l.address(), symbol.name(), bb);
+            loads_[l.address()] = result;
+        }
     }
 
-    virtual void visit(ast::Number * n) {
-        result = llvm::ConstantInt::get(context, llvm::APInt(32, n->value));
+    /** Stores the value in result to the variable, later loads of a global in the basic block reuse the value.
+     */
+    void emitStore(Location const & l) {
+        if (l.isLocal()) {
+            writeLocal(l.local(), bb, result);
+            return;
+        }
+        new llvm::StoreInst(result, l.address(), false, bb);
+        available();
+        loads_[l.address()] = result;
     }
 
-private:
+    /** Starts the local variables of a new function, whose entry block is in bb and has no predecessors.
+     */
+    void beginLocals() {
+        blocks_.clear();
+        localPhis_.clear();
+        locals_.clear();
+        sealBlock(bb);
+    }
+
+    int newLocal(Symbol symbol) {
+        locals_.push_back(symbol.name());
+        return locals_.size() - 1;
+    }
+
+    void writeLocal(int local, llvm::BasicBlock * block, llvm::Value * value) {
+        blocks_[block].definitions[local] = value;
+    }
+
+    /** Returns the value of the local variable at the end of the given block, as far as the block has been compiled.
+     */
+    llvm::Value * readLocal(int local, llvm::BasicBlock * block) {
+        SSABlock & b = blocks_[block];
+        auto i = b.definitions.find(local);
+        if (i != b.definitions.end())
+            return i->second;
+        llvm::Value * result;
+        if (not b.sealed) {
+            // predecessors are not known yet, the operands are added when the block is sealed
+            llvm::PHINode * phi = newLocalPhi(local, block);
+            b.incomplete.push_back(std::make_pair(local, phi));
+            result = phi;
+        } else if (llvm::BasicBlock * pred = block->getSinglePredecessor()) {
+            result = readLocal(local, pred);
+        } else if (llvm::pred_begin(block) == llvm::pred_end(block)) {
+            // read before any assignment, locals start as zero like the globals
+            result = zero;
+        } else {
+            // the phi breaks cycles of the lookup through loops
+            llvm::PHINode * phi = newLocalPhi(local, block);
+            writeLocal(local, block, phi);
+            result = addPhiOperands(local, phi);
+        }
+        writeLocal(local, block, result);
+        return result;
+    }
+
+    llvm::PHINode * newLocalPhi(int local, llvm::BasicBlock * block) {
+        llvm::PHINode * phi = block->empty() ?
+            llvm::PHINode::Create(t_int, 2, locals_[local], block) :
+            llvm::PHINode::Create(t_int, 2, locals_[local], &block->front());
+        localPhis_.insert(phi);
+        return phi;
+    }
+
+    llvm::Value * addPhiOperands(int local, llvm::PHINode * phi) {
+        llvm::BasicBlock * block = phi->getParent();
+        for (auto i = llvm::pred_begin(block), e = llvm::pred_end(block); i != e; ++i)
+            phi->addIncoming(readLocal(local, *i), *i);
+        return tryRemoveTrivialPhi(phi);
+    }
+
+    /** Replaces the phi by its only operand other than itself, if there is one, and then tries the same with the phis that used it.
+     */
+    llvm::Value * tryRemoveTrivialPhi(llvm::PHINode * phi) {
+        llvm::Value * same = nullptr;
+        for (unsigned i = 0, e = phi->getNumIncomingValues(); i != e; ++i) {
+            llvm::Value * op = phi->getIncomingValue(i);
+            if (op == same or op == phi)
+                continue;
+            if (same != nullptr)
+                return phi;
+            same = op;
+        }
+        if (same == nullptr)
+            same = zero;
+        std::vector<llvm::PHINode *> users;
+        for (llvm::User * u : phi->users()) {
+            llvm::PHINode * user = llvm::dyn_cast<llvm::PHINode>(u);
+            if (user != nullptr and user != phi and localPhis_.count(user))
+                users.push_back(user);
+        }
+        // the definitions refer to the phi through tracking value handles, which follow the replacement
+        phi->replaceAllUsesWith(same);
+        localPhis_.erase(phi);
+        phi->eraseFromParent();
+        for (llvm::PHINode * u : users)
+            if (localPhis_.count(u))
+                tryRemoveTrivialPhi(u);
+        return same;
+    }
+
+    /** Marks the block as having all its predecessors and completes the phis created while it had not.
+     */
+    void sealBlock(llvm::BasicBlock * block) {
+        SSABlock & b = blocks_[block];
+        std::vector<std::pair<int, llvm::PHINode *>> incomplete;
+        incomplete.swap(b.incomplete);
+        b.sealed = true;
+        for (auto const & i : incomplete)
+            addPhiOperands(i.first, i.second);
+        // removed phis might have been used by the available operations
+        if (not incomplete.empty())
+            forgetAvailable();
+    }
+
+    /** Operator applied to compiled operands, unary operators have no rhs.
+     */
+    struct Operation {
+        Token::Type type;
+        llvm::Value * lhs;
+        llvm::Value * rhs;
+
+        bool operator == (Operation const & other) const {
+            return type == other.type and lhs == other.lhs and rhs == other.rhs;
+        }
+
+        struct Hash {
+            size_t operator () (Operation const & op) const {
+                size_t h = std::hash<llvm::Value *>()(op.lhs);
+                h = h * 31 + std::hash<llvm::Value *>()(op.rhs);
+                return h * 31 + static_cast<size_t>(op.type);
+            }
+        };
+    };
+
+    /** Forgets the available values if the basic block has changed since they were computed, as they might not dominate it.
+     */
+    void available() {
+        if (availableBB_ != bb) {
+            forgetAvailable();
+            availableBB_ = bb;
+        }
+    }
+
+    void forgetAvailable() {
+        operations_.clear();
+        loads_.clear();
+        availableBB_ = nullptr;
+    }
+
+    /** If the operation has already been emitted in the basic block, sets result to its value and returns true.
+     */
+    bool reuse(Operation const & op) {
+        available();
+        auto i = operations_.find(op);
+        if (i == operations_.end())
+            return false;
+        result = i->second;
+        return true;
+    }
+
+    void emitNumber(int value) {
+        result = llvm::ConstantInt::get(context, llvm::APInt(32, value));
+    }
 
     class Location {
     public:
@@ -385,17 +838,34 @@ private:
             return Location(value, true);
         }
 
+        /** Local variable, whose value is an SSA value tracked by the code generator.
+         */
+        static Location local(int id) {
+            Location result(nullptr, false);
+            result.local_ = id;
+            return result;
+        }
+
         bool isConstant() const {
             return isConstant_;
         }
 
+        bool isLocal() const {
+            return local_ >= 0;
+        }
+
+        int local() const {
+            assert (isLocal());
+            return local_;
+        }
+
         llvm::Value * value() const {
             assert (isConstant_);
             return location_;
         }
 
         llvm::Value * address() const {
-            assert (not isConstant_);
+            assert (not isConstant_ and not isLocal());
             return location_;
         }
 
@@ -405,78 +875,558 @@ private:
 
         Location():
             location_(nullptr),
-            isConstant_(false) {
+            isConstant_(false),
+            local_(-1) {
         }
 
         Location(llvm::Value * location, bool isConstant):
             location_(location),
-            isConstant_(isConstant) {
+            isConstant_(isConstant),
+            local_(-1) {
         }
 
     private:
 
         llvm::Value * location_;
         bool isConstant_;
+        int local_;
     };
 
-    /** Compilation context for a block.
+    /** Binding of a symbol to its location, with the depth of the scope it was declared in, 0 if the symbol is not declared.
+     */
+    struct Binding {
+        Location location;
+        size_t scope;
+    };
 
+    llvm::Module * m;
 
+    llvm::Function * f;
+
+    llvm::BasicBlock * bb;
+
+    /** Current binding of each symbol, indexed by the symbol ids.
+
+        Declarations save the binding they shadow to the undo log, which is unrolled to its size at the start of the scope when the scope is closed, so that lookups are a single index and scopes allocate nothing once the vectors have grown.
      */
-    class BlockContext {
-    public:
+    std::vector<Binding> bindings_;
+
+    /** Symbol ids and the bindings their declarations replaced.
+     */
+    std::vector<std::pair<int, Binding>> undo_;
+
+    /** Size of the undo log at the start of each open scope.
+     */
+    std::vector<size_t> scopes_;
+
+    llvm::Value * result;
+
+    /** Values available for reuse in availableBB_.
+
+        Expressions are numbered while they are emitted: an operator on the same operand values as one already emitted in the basic block reuses its result and a load of a global reuses the last value loaded from or stored to it, locals are SSA values already. As the operands are themselves reused, structurally identical side effect free subexpressions are built only once. A store to a variable (assignment or read) replaces its value, so the operations on the old value are never matched again, and a call forgets the values of all globals, which the called function may change. Calls are never reused.
+     */
+    std::unordered_map<Operation, llvm::Value *, Operation::Hash> operations_;
+    std::unordered_map<llvm::Value *, llvm::Value *> loads_;
+    llvm::BasicBlock * availableBB_;
+
+    /** SSA construction state of a basic block.
+     */
+    struct SSABlock {
+        /** Current value of each local variable defined or looked up in the block.
+         */
+        std::unordered_map<int, llvm::WeakTrackingVH> definitions;
+
+        /** Phis created before the block was sealed, whose operands are still to be added.
+         */
+        std::vector<std::pair<int, llvm::PHINode *>> incomplete;
+
+        /** True when all predecessors of the block are known.
+         */
+        bool sealed = false;
+    };
+
+    /** Local variables of the function being compiled are SSA values, constructed on the fly (Braun et al., Simple and Efficient Construction of Static Single Assignment Form).
+
+        Assignments record the value in the current block and reads look it up through the predecessors, placing phis where they meet. A block is sealed once all its predecessors are known, phis needed in an unsealed block (a loop condition before its back edge) are completed when it is sealed. Phis that turn out to have a single distinct operand are replaced by it.
+     */
+    std::unordered_map<llvm::BasicBlock *, SSABlock> blocks_;
+
+    /** Widened comparisons whose branches use the comparisons directly, the widening is removed at the end of the function if unused.
+     */
+    std::vector<llvm::WeakVH> widened_;
+
+    /** Phis created for local variables, only these may be removed as trivial.
+     */
+    std::unordered_set<llvm::PHINode *> localPhis_;
+
+    /** Names of the local variables of the function, indexed by their ids.
+     */
+    std::vector<char const *> locals_;
+
+    /** When set, globals are declared as defined in another module.
+     */
+    bool externalGlobals_;
+
+    /** When set, multiplications by powers of two are emitted as shifts (only for simplified modules).
+     */
+    bool reduceStrength_;
+
+    /** Number of arguments of the functions defined in other modules indexed by their symbol ids, -1 for the other symbols.
+     */
+    std::vector<int> externals_;
+
+    llvm::LLVMContext & context;
+
+    llvm::Type * t_int;
+    llvm::Type * t_void;
+
+    llvm::FunctionType * t_read;
+    llvm::FunctionType * t_write;
+
+    llvm::Value * zero;
+    llvm::Value * one;
+};
+
+/** Compiler of the pointer linked AST, dispatches statically on the node kinds.
+ */
+class Compiler: public CodeGen, public ast::StaticVisitor<Compiler> {
+public:
+    static llvm::Function * compile(ast::Module * module) {
+        Compiler c;
+        c.reduceStrength_ = module->simplified;
+        c.generate(module->context, [&] () { c.dispatch(module); });
+
+        // return the main function
+        return c.f;
+    }
+
+    /** Compiles the functions of the module in parallel on the pool and returns the main function in the global context.
+
+        This is experimental and only used by mila+ when asked for with --shards, as the serial moving and linking of the shards' bitcode has so far made it slower than the serial compilation (see --bench shards).
+
+        With a single worker the module is compiled serially, otherwise the functions are split into the given number of shards of consecutive functions (by default a few per worker), each compiled into its own module in its own LLVM context. A shard declares the globals and the functions before it as externals, so that it sees exactly what the serial compilation would at that point, and reports the same errors, of which that of the first shard wins. The shards are then moved to the global context as bitcode and linked, in order, into the module of main.
+     */
+    static llvm::Function * compile(ast::Module * module, ThreadPool & pool, size_t shards = 0) {
+        ast::List<ast::Function *> const & fs = module->functions->functions;
+        if (pool.size() < 2)
+            return compile(module);
+        if (shards == 0)
+            shards = pool.size() * SHARDS_PER_THREAD;
+        shards = std::min(shards, fs.size() / MIN_SHARD);
+        if (shards < 2)
+            return compile(module);
+        std::vector<std::string> bitcode(shards);
+        // errors in the shards resolve their lines
+        module->context.lines.build();
+        pool.parallelFor(shards, [&] (size_t i) {
+            llvm::LLVMContext context;
+            Compiler c(context);
+            c.reduceStrength_ = module->simplified;
+            c.generate(module->context, [&] () { c.compileShard(module, fs.size() * i / shards, fs.size() * (i + 1) / shards); });
+            llvm::raw_string_ostream s(bitcode[i]);
+            llvm::WriteBitcodeToFile(c.m, s);
+            s.flush();
+            delete c.m;
+        });
+        Compiler c;
+        c.reduceStrength_ = module->simplified;
+        c.generate(module->context, [&] () {
+            c.emitModule();
+            c.compileDeclarations(module->declarations, true);
+            for (ast::Function * f : fs)
+                c.declareExternal(f->name, f->arguments.size());
+            for (std::string const & b : bitcode)
+                c.emitLink(b);
+            c.emitMain([&] () { c.dispatch(module->body); });
+        });
+        return c.f;
+    }
+
+protected:
+    friend class ast::StaticVisitor<Compiler>;
+
+    Compiler(llvm::LLVMContext & context = globalContext()):
+        CodeGen(context) {
+    }
+
+    /** Compiles functions [first, last) of the module into a module whose globals and other functions are defined elsewhere.
+     */
+    void compileShard(ast::Module * module, size_t first, size_t last) {
+        ast::List<ast::Function *> const & fs = module->functions->functions;
+        emitModule();
+        externalGlobals_ = true;
+        compileDeclarations(module->declarations, true);
+        for (size_t i = 0; i != first; ++i)
+            declareExternal(fs[i]->name, fs[i]->arguments.size());
+        for (size_t i = first; i != last; ++i)
+            dispatch(fs[i]);
+    }
+
+    /** Minimal number of functions in a shard.
+     */
+    static constexpr size_t MIN_SHARD = 16;
+
+    static constexpr size_t SHARDS_PER_THREAD = 4;
+
+    void visit(ast::Node * n) {
+        throw Exception("Unknown compiler handler");
+    }
+
+    void visit(ast::Expression * d) {
+        throw Exception("Unknown compiler handler");
+    }
+
+    void compileDeclarations(ast::Declarations * ds, bool isGlobal = false) {
+        for (ast::Declaration * d : ds->declarations) {
+            if (d->value == nullptr) {
+                emitVariable(d->symbol, d->offset, isGlobal);
+            } else  {
+                dispatch(d->value);
+                emitConstant(d->symbol, d->offset);
+            }
+        }
+    }
+
+    void visit(ast::Declaration * d) {
+        throw Exception("This should be unreachable");
+    }
+
+    void visit(ast::Function * f) {
+        emitFunction(f->name, f->arguments.size(), f->offset);
+        for (size_t i = 0, e = f->arguments.size(); i != e; ++i)
+            emitArgument(i, f->arguments[i], f->offset);
+        // compile the body of the function
+        compileFunctionBody(f->body);
+        // close the scope
+        closeScope();
+    }
+
+    void compileFunctionBody(ast::Node * node) {
+        // now compile the body
+        dispatch(node);
+        emitFunctionEnd();
+    }
+
+    void visit(ast::Functions * fs) {
+        for (ast::Function * f : fs->functions)
+            dispatch(f);
+    }
+
+    void visit(ast::Declarations * ds) {
+        compileDeclarations(ds);
+    }
+
+    void visit(ast::Module * module) {
+        emitModule();
+        compileDeclarations(module->declarations, true);
+        // compile all functions
+        dispatch(module->functions);
+        // now create main function, and compile the pre-block declarations
+        emitMain([&] () { dispatch(module->body); });
+    }
 
-        bool hasVariable(Symbol symbol) const {
-            return variables.find(symbol) != variables.end();
+    void visit(ast::Block * d) {
+        // open the scope of the block
+        openScope();
+        // compile declarations
+        dispatch(d->declarations);
+        // and all statements in the block
+        for (ast::Node * s : d->statements) {
+            emitStatement(s->offset);
+            dispatch(s);
         }
+        // close the scope
+        closeScope();
+    }
+
+    void visit(ast::Write * w) {
+        dispatch(w->expression);
+        emitWrite();
+    }
+
+    void visit(ast::Read * r) {
+        emitRead(r->symbol, r->offset);
+    }
+
+    void visit(ast::If * s) {
+        emitIf([&] () { dispatch(s->condition); },
+               [&] () { dispatch(s->trueCase); },
+               [&] () { dispatch(s->falseCase); });
+    }
+
+    void visit(ast::While * d) {
+        emitWhile([&] () { dispatch(d->condition); },
+                  [&] () { dispatch(d->body); });
+    }
+
+    void visit(ast::Return * r) {
+        dispatch(r->value);
+        emitReturn();
+    }
+
+    void visit(ast::Assignment * a) {
+        dispatch(a->value);
+        emitAssignment(a->symbol, a->offset);
+    }
 
-        Location const & get(Symbol symbol, ast::Node * ast) {
-            auto i = variables.find(symbol);
-            if (i != variables.end())
-                return i->second;
-            if (parent != nullptr)
-                return parent->get(symbol, ast);
-            throw CompilerError(STR("Variable or constant " << symbol << " not found"), ast);
+    void visit(ast::Call * call) {
+        std::vector<llvm::Value * > args;
+        for (ast::Node * a : call->arguments) {
+            dispatch(a);
+            args.push_back(result);
         }
+        emitCall(call->function, args, call->offset);
+    }
+
+    void visit(ast::Binary * op) {
+        dispatch(op->lhs);
+        llvm::Value * lhsValue = result;
+        dispatch(op->rhs);
+        emitBinary(op->type, lhsValue);
+    }
+
+    void visit(ast::Unary * op) {
+        dispatch(op->operand);
+        emitUnary(op->type);
+    }
+
+    void visit(ast::Variable * v) {
+        emitLoad(v->symbol, v->offset);
+    }
 
-        std::map<Symbol, Location> variables;
+    void visit(ast::Number * n) {
+        emitNumber(n->value);
+    }
+};
 
-        BlockContext * parent;
+/** Compiler on an explicit stack for arbitrarily deep trees, produces the same code as Compiler.
 
+    Ifs and whiles being compiled keep their state on their own stacks, the values of left operands and call arguments compiled so far are kept on the values stack.
+ */
+class IterativeCompiler: public CodeGen, public ast::IterativeVisitor {
+public:
+    static llvm::Function * compile(ast::Module * module) {
+        IterativeCompiler c;
+        c.reduceStrength_ = module->simplified;
+        c.generate(module->context, [&] () { c.traverse(module); });
 
+        // return the main function
+        return c.f;
+    }
+
+protected:
+    virtual void visit(ast::Node * n) {
+        throw Exception("Unknown compiler handler");
+    }
+
+    virtual void visit(ast::Expression * d) {
+        throw Exception("Unknown compiler handler");
+    }
 
-        BlockContext(BlockContext * parent = nullptr):
-            parent(parent) {
+    /** Declared constants are always numbers, so declarations are compiled without traversal.
+     */
+    void compileDeclarations(ast::Declarations * ds, bool isGlobal = false) {
+        for (ast::Declaration * d : ds->declarations) {
+            if (d->value == nullptr) {
+                emitVariable(d->symbol, d->offset, isGlobal);
+            } else  {
+                emitNumber(d->value->value);
+                emitConstant(d->symbol, d->offset);
+            }
         }
+    }
 
-    };
+    virtual void visit(ast::Declaration * d) {
+        throw Exception("This should be unreachable");
+    }
 
-    llvm::Module * m;
+    virtual void visit(ast::Function * f) {
+        if (step() == 0) {
+            emitFunction(f->name, f->arguments.size(), f->offset);
+            for (size_t i = 0, e = f->arguments.size(); i != e; ++i)
+                emitArgument(i, f->arguments[i], f->offset);
+            push(f, 1);
+            push(f->body);
+        } else {
+            emitFunctionEnd();
+            // close the scope
+            closeScope();
+        }
+    }
 
-    llvm::Function * f;
+    virtual void visit(ast::Functions * fs) {
+        for (size_t i = fs->functions.size(); i > 0; --i)
+            push(fs->functions[i - 1]);
+    }
 
-    llvm::BasicBlock * bb;
+    virtual void visit(ast::Declarations * ds) {
+        compileDeclarations(ds);
+    }
+
+    virtual void visit(ast::Module * module) {
+        switch (step()) {
+            case 0:
+                emitModule();
+                compileDeclarations(module->declarations, true);
+                push(module, 1);
+                push(module->functions);
+                break;
+            case 1:
+                emitMainBegin();
+                push(module, 2);
+                push(module->body);
+                break;
+            default:
+                emitFunctionEnd();
+        }
+    }
 
-    BlockContext * c;
+    /** Step i compiles the i-th statement.
+     */
+    virtual void visit(ast::Block * d) {
+        size_t i = step();
+        if (i == 0) {
+            openScope();
+            compileDeclarations(d->declarations);
+        }
+        if (i < d->statements.size()) {
+            emitStatement(d->statements[i]->offset);
+            push(d, i + 1);
+            push(d->statements[i]);
+        } else {
+            closeScope();
+        }
+    }
 
-    llvm::Value * result;
+    virtual void visit(ast::Write * w) {
+        if (step() == 0) {
+            push(w, 1);
+            push(w->expression);
+        } else {
+            emitWrite();
+        }
+    }
+
+    virtual void visit(ast::Read * r) {
+        emitRead(r->symbol, r->offset);
+    }
+
+    virtual void visit(ast::If * s) {
+        switch (step()) {
+            case 0:
+                push(s, 1);
+                push(s->condition);
+                break;
+            case 1:
+                branches_.push_back(emitIfCondition());
+                push(s, 2);
+                push(s->trueCase);
+                break;
+            case 2:
+                emitIfTrueCase(branches_.back());
+                push(s, 3);
+                push(s->falseCase);
+                break;
+            default:
+                emitIfFalseCase(branches_.back());
+                branches_.pop_back();
+        }
+    }
+
+    virtual void visit(ast::While * d) {
+        switch (step()) {
+            case 0:
+                loops_.push_back(emitWhileBegin());
+                push(d, 1);
+                push(d->condition);
+                break;
+            case 1:
+                emitWhileCondition(loops_.back());
+                push(d, 2);
+                push(d->body);
+                break;
+            default:
+                emitWhileBody(loops_.back());
+                loops_.pop_back();
+        }
+    }
 
+    virtual void visit(ast::Return * r) {
+        if (step() == 0) {
+            push(r, 1);
+            push(r->value);
+        } else {
+            emitReturn();
+        }
+    }
 
+    virtual void visit(ast::Assignment * a) {
+        if (step() == 0) {
+            push(a, 1);
+            push(a->value);
+        } else {
+            emitAssignment(a->symbol, a->offset);
+        }
+    }
 
-    static llvm::Type * t_int;
-    static llvm::Type * t_void;
+    /** Step i compiles the i-th argument.
+     */
+    virtual void visit(ast::Call * call) {
+        size_t i = step();
+        if (i > 0)
+            values_.push_back(result);
+        if (i < call->arguments.size()) {
+            push(call, i + 1);
+            push(call->arguments[i]);
+        } else {
+            std::vector<llvm::Value * > args(values_.end() - i, values_.end());
+            values_.resize(values_.size() - i);
+            emitCall(call->function, args, call->offset);
+        }
+    }
 
-    static llvm::FunctionType * t_read;
-    static llvm::FunctionType * t_write;
+    virtual void visit(ast::Binary * op) {
+        switch (step()) {
+            case 0:
+                push(op, 1);
+                push(op->lhs);
+                break;
+            case 1:
+                values_.push_back(result);
+                push(op, 2);
+                push(op->rhs);
+                break;
+            default: {
+                llvm::Value * lhsValue = values_.back();
+                values_.pop_back();
+                emitBinary(op->type, lhsValue);
+            }
+        }
+    }
 
+    virtual void visit(ast::Unary * op) {
+        if (step() == 0) {
+            push(op, 1);
+            push(op->operand);
+        } else {
+            emitUnary(op->type);
+        }
+    }
 
-    static llvm::Value * zero;
-    static llvm::Value * one;
+    virtual void visit(ast::Variable * v) {
+        emitLoad(v->symbol, v->offset);
+    }
 
-    static llvm::LLVMContext & context;
+    virtual void visit(ast::Number * n) {
+        emitNumber(n->value);
+    }
 
+private:
+    std::vector<Branch> branches_;
+    std::vector<Loop> loops_;
+    std::vector<llvm::Value *> values_;
 };
-  
+
 }
 
 #endif
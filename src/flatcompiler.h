@@ -0,0 +1,222 @@
+#ifndef FLATCOMPILER_H
+#define FLATCOMPILER_H
+
+#include "compiler.h"
+
+#include "mila/flat.h"
+
+namespace mila {
+
+/** Compiler of the flat AST.
+
+    Produces the same code as Compiler, but walks the tree by switching on the node kinds instead of visitor's virtual calls.
+
+    This is experimental, --flat is not meant to be used by default. The cheaper walk was meant to make the code generation faster, but --bench codegen has not measured it faster than Compiler (on 5000 generated functions 111-119 ms against 114-118 ms), the time is spent constructing the LLVM IR. The flat tree only wins in parsing (about 6%) and memory (about 23% smaller).
+ */
+class FlatCompiler: public CodeGen {
+public:
+    static llvm::Function * compile(flat::Tree const & tree) {
+        FlatCompiler c(tree);
+        c.generate(tree.context, [&] () { c.compileModule(tree.root); });
+
+        // return the main function
+        return c.f;
+    }
+
+protected:
+    typedef flat::Index Index;
+    typedef flat::Kind Kind;
+
+    FlatCompiler(flat::Tree const & tree):
+        t(tree) {
+    }
+
+    void compileModule(Index n) {
+        emitModule();
+        compileDeclarations(t.b(n), true);
+        // compile all functions
+        for (Index f : t.list(t.a(n)))
+            compileFunction(f);
+        // now create main function, and compile the pre-block declarations
+        emitMain([&] () { compileNode(t.c(n)); });
+    }
+
+    void compileDeclarations(Index list, bool isGlobal = false) {
+        for (Index d : t.list(list)) {
+            if (t.b(d) == flat::NONE) {
+                emitVariable(t.symbol(d), t.offset(d), isGlobal);
+            } else {
+                compileNode(t.b(d));
+                emitConstant(t.symbol(d), t.offset(d));
+            }
+        }
+    }
+
+    void compileFunction(Index n) {
+        flat::Tree::List arguments = t.list(t.b(n));
+        emitFunction(t.symbol(n), arguments.size(), t.offset(n));
+        for (size_t i = 0, e = arguments.size(); i != e; ++i)
+            emitArgument(i, t.symbolOf(arguments[i]), t.offset(n));
+        // compile the body of the function
+        compileNode(t.c(n));
+        emitFunctionEnd();
+        // close the scope
+        closeScope();
+    }
+
+    /** Compiles the given node and its children.
+
+        The tree is walked on an explicit stack so that arbitrarily deep trees can be compiled. Each node on the stack has a step telling where to continue when it is resumed after its child, ifs and whiles being compiled keep their state on their own stacks and the values of left operands and call arguments compiled so far are on the values stack.
+     */
+    void compileNode(Index root) {
+        size_t base = stack_.size();
+        push(root);
+        while (stack_.size() != base) {
+            Index n = stack_.back().node;
+            uint32_t step = stack_.back().step;
+            stack_.pop_back();
+            switch (t.kind(n)) {
+                case Kind::Block: {
+                    flat::Tree::List statements = t.list(t.b(n));
+                    if (step == 0) {
+                        // open the scope of the block
+                        openScope();
+                        compileDeclarations(t.a(n));
+                    }
+                    if (step < statements.size()) {
+                        emitStatement(t.offset(statements[step]));
+                        push(n, step + 1, statements[step]);
+                    } else {
+                        // close the scope
+                        closeScope();
+                    }
+                    break;
+                }
+                case Kind::Write:
+                    if (step == 0)
+                        push(n, 1, t.a(n));
+                    else
+                        emitWrite();
+                    break;
+                case Kind::Read:
+                    emitRead(t.symbol(n), t.offset(n));
+                    break;
+                case Kind::If:
+                    switch (step) {
+                        case 0:
+                            push(n, 1, t.a(n));
+                            break;
+                        case 1:
+                            branches_.push_back(emitIfCondition());
+                            push(n, 2, t.b(n));
+                            break;
+                        case 2:
+                            emitIfTrueCase(branches_.back());
+                            push(n, 3, t.c(n));
+                            break;
+                        default:
+                            emitIfFalseCase(branches_.back());
+                            branches_.pop_back();
+                    }
+                    break;
+                case Kind::While:
+                    switch (step) {
+                        case 0:
+                            loops_.push_back(emitWhileBegin());
+                            push(n, 1, t.a(n));
+                            break;
+                        case 1:
+                            emitWhileCondition(loops_.back());
+                            push(n, 2, t.b(n));
+                            break;
+                        default:
+                            emitWhileBody(loops_.back());
+                            loops_.pop_back();
+                    }
+                    break;
+                case Kind::Return:
+                    if (step == 0)
+                        push(n, 1, t.a(n));
+                    else
+                        emitReturn();
+                    break;
+                case Kind::Assignment:
+                    if (step == 0)
+                        push(n, 1, t.b(n));
+                    else
+                        emitAssignment(t.symbol(n), t.offset(n));
+                    break;
+                case Kind::Call: {
+                    flat::Tree::List arguments = t.list(t.b(n));
+                    if (step > 0)
+                        values_.push_back(result);
+                    if (step < arguments.size()) {
+                        push(n, step + 1, arguments[step]);
+                    } else {
+                        std::vector<llvm::Value * > args(values_.end() - step, values_.end());
+                        values_.resize(values_.size() - step);
+                        emitCall(t.symbol(n), args, t.offset(n));
+                    }
+                    break;
+                }
+                case Kind::Binary:
+                    switch (step) {
+                        case 0:
+                            push(n, 1, t.a(n));
+                            break;
+                        case 1:
+                            values_.push_back(result);
+                            push(n, 2, t.b(n));
+                            break;
+                        default: {
+                            llvm::Value * lhsValue = values_.back();
+                            values_.pop_back();
+                            emitBinary(t.op(n), lhsValue);
+                        }
+                    }
+                    break;
+                case Kind::Unary:
+                    if (step == 0)
+                        push(n, 1, t.a(n));
+                    else
+                        emitUnary(t.op(n));
+                    break;
+                case Kind::Variable:
+                    emitLoad(t.symbol(n), t.offset(n));
+                    break;
+                case Kind::Number:
+                    emitNumber(t.value(n));
+                    break;
+                default:
+                    throw Exception("This should be unreachable");
+            }
+        }
+    }
+
+    void push(Index n, uint32_t step = 0) {
+        stack_.push_back(Item{n, step});
+    }
+
+    /** Pushes the node to be resumed at the given step after its child.
+     */
+    void push(Index n, uint32_t step, Index child) {
+        push(n, step);
+        push(child);
+    }
+
+    struct Item {
+        Index node;
+        uint32_t step;
+    };
+
+    flat::Tree const & t;
+
+    std::vector<Item> stack_;
+    std::vector<Branch> branches_;
+    std::vector<Loop> loops_;
+    std::vector<llvm::Value *> values_;
+};
+
+}
+
+#endif
@@ -33,6 +33,12 @@ public:
     typedef int (*MainPtr)();
 
     static MainPtr compile(llvm::Function * main) {
+        return reinterpret_cast<MainPtr>(engine(main)->getPointerToFunction(main));
+    }
+
+    /** Creates the execution engine owning the module of the given main function, with the code already generated.
+     */
+    static llvm::ExecutionEngine * engine(llvm::Function * main) {
         llvm::Module * m = main->getParent();
 
         std::string err;
@@ -54,7 +60,7 @@ public:
             .setMCJITMemoryManager(std::unique_ptr<MemoryManager>(new MemoryManager()))
             .create();
         engine->finalizeObject(); */
-        return reinterpret_cast<MainPtr>(engine->getPointerToFunction(main));
+        return engine;
     }
 };
 
@@ -1,76 +1,209 @@
-/* main.c */
-/* syntakticky analyzator */
-
-#include <cstdlib>
-#include <iostream>
-#include <stdio.h>
-
-#include "llvm.h"
-
-#include "mila/ast.h"
-#include "mila/scanner.h"
-#include "mila/parser.h"
-#include "mila/printer.h"
-#include "compiler.h"
-#include "jit.h"
-
-#include "abstractinterpretation.h"
-
-using namespace mila;
-
-int main(int argc, char const * argv[]) {
-    // initialize the JIT
-    LLVMInitializeNativeTarget();
-    LLVMInitializeNativeAsmPrinter();
-    LLVMInitializeNativeAsmParser();
-    try {
-        char const * filename = nullptr;
-        bool verbose = false;
-        char const * emitir = nullptr;
-        for (int i = 1; i < argc; ++i) {
-            if (strncmp(argv[i],"--verbose", 10) == 0)
-                verbose = true;
-            else if (strncmp(argv[i], "--emit", 7) == 0) {
-                emitir = argv[++i];
-                std::cout << emitir << std::endl;
-            }
-            else if (filename != nullptr)
-                throw Exception("Invalid usage! mila+ [--verbose] [--emit filename] filename");
-            else
-                filename = argv[i];
-        }
-        ast::Module * m = Parser::parse(Scanner::file(filename));
-        if (verbose)
-            ast::Printer::print(m);
-        llvm::Function * f = Compiler::compile(m);
-        if (verbose)
-            f->getParent()->print(llvm::outs(), nullptr);
-        
-        //llvm::PassRegistry * pr = llvm::PassRegistry::getPassRegistry();
-        //std::cout << "[mem2reg] Run Pass" << std::endl;
-        
-        //llvm::FunctionPass * mem2reg_pass = llvm::createPromoteMemoryToRegisterPass();
-
-        //pr->add(mem2reg_pass);
-
-        //llvm::initializeCore(*pr);
-
-        //if (verbose)
-        //    f->getParent()->print(llvm::outs(), nullptr);
-
-        //NameTheUnnamed(f, verbose);
-        //AbstractInterpretation::dummy(f, verbose); 
-
-        if (emitir != nullptr) {
-            std::error_code error;
-            llvm::raw_fd_ostream o(emitir, error, llvm::sys::fs::OpenFlags::F_None);
-            llvm::WriteBitcodeToFile(f->getParent(), o);
-        } else {
-            std::cout << JIT::compile(f)() << std::endl;
-        }
-        return EXIT_SUCCESS;
-    } catch (std::exception const & e) {
-        std::cerr << e.what() << std::endl;
-        return EXIT_FAILURE;
-    }
-}
+/* main.c */
+/* syntakticky analyzator */
+
+#include <cstdlib>
+#include <iostream>
+#include <stdio.h>
+
+#include "llvm.h"
+
+#include "mila/ast.h"
+#include "mila/scanner.h"
+#include "mila/parser.h"
+#include "mila/printer.h"
+#include "mila/cache.h"
+#include "mila/simplifier.h"
+#include "compiler.h"
+#include "flatcompiler.h"
+#include "jit.h"
+#include "optimizer.h"
+#include "native.h"
+#include "bench.h"
+
+#include "abstractinterpretation.h"
+
+using namespace mila;
+
+int main(int argc, char const * argv[]) {
+    // initialize the JIT
+    LLVMInitializeNativeTarget();
+    LLVMInitializeNativeAsmPrinter();
+    LLVMInitializeNativeAsmParser();
+    try {
+        char const * filename = nullptr;
+        bool verbose = false;
+        bool stats = false;
+        bool flat = false;
+        bool iterative = false;
+        bool simplify = false;
+        bool compact = false;
+        int optimize = -1;
+        std::vector<std::string> passes;
+        char const * emitir = nullptr;
+        char const * object = nullptr;
+        char const * executable = nullptr;
+        char const * runtime = MILA_RUNTIME;
+        char const * bench = nullptr;
+        char const * cache = nullptr;
+        unsigned threads = 1;
+        size_t shards = 0;
+        for (int i = 1; i < argc; ++i) {
+            if (strncmp(argv[i],"--verbose", 10) == 0)
+                verbose = true;
+            else if (strncmp(argv[i], "--stats", 8) == 0)
+                stats = true;
+            else if (strncmp(argv[i], "--emit", 7) == 0) {
+                emitir = argv[++i];
+                std::cout << emitir << std::endl;
+            }
+            else if (strncmp(argv[i], "--bench", 8) == 0)
+                bench = argv[++i];
+            else if (strncmp(argv[i], "--threads", 10) == 0)
+                threads = atoi(argv[++i]);
+            else if (strncmp(argv[i], "--shards", 9) == 0)
+                shards = atoi(argv[++i]);
+            else if (strncmp(argv[i], "--flat", 7) == 0)
+                flat = true;
+            else if (strncmp(argv[i], "--iterative", 12) == 0)
+                iterative = true;
+            else if (strncmp(argv[i], "--cache", 8) == 0)
+                cache = argv[++i];
+            else if (strncmp(argv[i], "--simplify", 11) == 0)
+                simplify = true;
+            else if (strncmp(argv[i], "--compact", 10) == 0)
+                compact = true;
+            else if (strncmp(argv[i], "-O", 2) == 0 and argv[i][2] >= '0' and argv[i][2] <= '3' and argv[i][3] == 0)
+                optimize = argv[i][2] - '0';
+            else if (strncmp(argv[i], "--passes", 9) == 0)
+                passes = Optimizer::passes(argv[++i]);
+            else if (strncmp(argv[i], "--load", 7) == 0)
+                Optimizer::load(argv[++i]);
+            else if (strncmp(argv[i], "--object", 9) == 0)
+                object = argv[++i];
+            else if (strncmp(argv[i], "--native", 9) == 0)
+                executable = argv[++i];
+            else if (strncmp(argv[i], "--runtime", 10) == 0)
+                runtime = argv[++i];
+            else if (filename != nullptr)
+                throw Exception("Invalid usage! mila+ [--verbose] [--stats] [--emit filename] [--bench what] [--threads n] [--shards n] [--flat] [--iterative] [--cache directory] [--simplify] [--compact] [-O0..-O3] [--passes p1,p2...] [--load plugin] [--object filename] [--native filename] [--runtime library] filename");
+            else
+                filename = argv[i];
+        }
+        if (bench != nullptr) {
+            Bench::run(bench, filename != nullptr ? filename : "");
+            return EXIT_SUCCESS;
+        }
+        if (simplify and flat)
+            throw Exception("Only the pointer linked AST can be simplified, --simplify cannot be used with --flat");
+        if (compact and (flat or iterative))
+            throw Exception("Only the buffered printer prints compact, --compact cannot be used with --flat or --iterative");
+        Context context;
+        std::unique_ptr<ThreadPool> pool(threads > 1 ? new ThreadPool(threads) : nullptr);
+        auto scan = [&] () {
+            return pool ? Scanner::parallel(context, filename, *pool) : Scanner::map(context, filename, true);
+        };
+        llvm::Function * f;
+        size_t simplifiedNodes = 0;
+        size_t simplifiedInstructions = 0;
+        auto instructions = [] (llvm::Function * f) {
+            size_t result = 0;
+            for (llvm::Function & fn : *f->getParent())
+                for (llvm::BasicBlock & bb : fn)
+                    result += bb.size();
+            return result;
+        };
+        std::unique_ptr<flat::Tree> tree;
+        std::unique_ptr<AstCache> astCache(cache != nullptr ? new AstCache(cache) : nullptr);
+        if (astCache) {
+            // the cache keeps flat trees, the pointer AST is expanded from them, so a miss parses serially even with --threads
+            tree.reset(astCache->load(context, filename));
+            if (not tree) {
+                tree.reset(FlatParser::parse(scan(), nullptr, iterative));
+                astCache->store(*tree);
+            }
+        } else if (flat) {
+            tree.reset(FlatParser::parse(scan(), nullptr, iterative));
+        }
+        if (flat) {
+            // the flat tree is experimental, its code generation has not yet been measured faster than that of the pointer linked AST
+            if (verbose)
+                flat::Printer::print(*tree);
+            f = FlatCompiler::compile(*tree);
+        } else {
+            ast::Module * m = tree ? AstCache::expand(*tree) : Parser::parse(scan(), pool.get(), iterative);
+            auto compile = [&] () {
+                if (iterative)
+                    return IterativeCompiler::compile(m);
+                // sharded code generation is experimental, it has not yet been measured faster than the serial one
+                return pool and shards > 0 ? Compiler::compile(m, *pool, shards) : Compiler::compile(m);
+            };
+            if (simplify) {
+                // the instructions removed are only known by compiling the module also before the simplification
+                if (stats) {
+                    llvm::Function * original = compile();
+                    simplifiedInstructions = instructions(original);
+                    delete original->getParent();
+                }
+                simplifiedNodes = ast::Simplifier::simplify(m);
+            }
+            if (verbose) {
+                if (iterative)
+                    ast::IterativePrinter::print(m);
+                else
+                    ast::BufferedPrinter::print(m, compact);
+            }
+            f = compile();
+        }
+        // counted before the optimizer, so that the simplifier is not credited with what the optimizer removed
+        size_t compiledInstructions = instructions(f);
+        if (optimize >= 0 or not passes.empty())
+            Optimizer::run(f->getParent(), optimize < 0 ? 0 : optimize, passes);
+        if (verbose)
+            f->getParent()->print(llvm::outs(), nullptr);
+        if (stats) {
+            if (astCache)
+                std::cout << "cache: " << (astCache->hit() ? "hit " : "miss ") << astCache->path() << ", " << astCache->bytes() << " bytes" << std::endl;
+            if (simplify)
+                std::cout << "simplify: " << simplifiedNodes << " nodes removed, " << (simplifiedInstructions - compiledInstructions) << " instructions removed" << std::endl;
+            if (optimize >= 0 or not passes.empty())
+                std::cout << "optimize: " << compiledInstructions << " instructions before, " << instructions(f) << " after" << std::endl;
+            std::cout << "symbols: " << context.symbols.size() << " interned, " << context.symbols.bytes() << " bytes" << std::endl;
+            if (flat)
+                std::cout << "ast: " << tree->size() << " flat nodes, " << tree->bytes() << " bytes" << std::endl;
+            else
+                std::cout << "ast: " << context.nodes.allocations() << " allocations, " << context.nodes.bytes() << " bytes in " << context.nodes.chunks() << " chunks" << std::endl;
+        }
+        
+        //llvm::PassRegistry * pr = llvm::PassRegistry::getPassRegistry();
+        //std::cout << "[mem2reg] Run Pass" << std::endl;
+        
+        //llvm::FunctionPass * mem2reg_pass = llvm::createPromoteMemoryToRegisterPass();
+
+        //pr->add(mem2reg_pass);
+
+        //llvm::initializeCore(*pr);
+
+        //if (verbose)
+        //    f->getParent()->print(llvm::outs(), nullptr);
+
+        //NameTheUnnamed(f, verbose);
+        //AbstractInterpretation::dummy(f, verbose); 
+
+        if (emitir != nullptr) {
+            std::error_code error;
+            llvm::raw_fd_ostream o(emitir, error, llvm::sys::fs::OpenFlags::F_None);
+            llvm::WriteBitcodeToFile(f->getParent(), o);
+        }
+        if (object != nullptr)
+            Native::object(f->getParent(), object);
+        if (executable != nullptr)
+            Native::executable(f->getParent(), executable, runtime);
+        if (emitir == nullptr and object == nullptr and executable == nullptr) {
+            std::cout << JIT::compile(f)() << std::endl;
+        }
+        return EXIT_SUCCESS;
+    } catch (std::exception const & e) {
+        std::cerr << e.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+}
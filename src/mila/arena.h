@@ -0,0 +1,136 @@
+#ifndef MILA_ARENA_H
+#define MILA_ARENA_H
+
+#include <cstddef>
+#include <cstdint>
+
+#include <memory>
+#include <vector>
+
+namespace mila {
+
+/** Bump allocator.
+
+    Memory is handed out from large chunks and is never freed individually, everything is released at once when the arena is destroyed. Destructors of objects placed in the arena are not called, so only objects whose destructors do nothing but free memory (possibly from the same arena) may live in it.
+ */
+class Arena {
+public:
+    Arena():
+        pos_(nullptr),
+        remaining_(0),
+        allocations_(0),
+        bytes_(0) {
+    }
+
+    Arena(Arena const &) = delete;
+
+    Arena & operator = (Arena const &) = delete;
+
+    void * allocate(size_t size, size_t align) {
+        size_t padding = (align - reinterpret_cast<uintptr_t>(pos_) % align) % align;
+        if (size + padding > remaining_) {
+            size_t chunk = CHUNK_SIZE;
+            if (size + align > chunk)
+                chunk = size + align;
+            chunks_.push_back(std::unique_ptr<char[]>(new char[chunk]));
+            pos_ = chunks_.back().get();
+            remaining_ = chunk;
+            padding = (align - reinterpret_cast<uintptr_t>(pos_) % align) % align;
+        }
+        void * result = pos_ + padding;
+        pos_ += size + padding;
+        remaining_ -= size + padding;
+        ++allocations_;
+        bytes_ += size;
+        return result;
+    }
+
+    /** Takes over all memory of the other arena, which is left empty.
+
+        The objects allocated from the other arena stay where they are and are then released with this one.
+     */
+    void adopt(Arena & other) {
+        for (std::unique_ptr<char[]> & chunk : other.chunks_)
+            chunks_.push_back(std::move(chunk));
+        allocations_ += other.allocations_;
+        bytes_ += other.bytes_;
+        other.chunks_.clear();
+        other.pos_ = nullptr;
+        other.remaining_ = 0;
+        other.allocations_ = 0;
+        other.bytes_ = 0;
+    }
+
+    /** Number of allocations made from the arena.
+     */
+    size_t allocations() const {
+        return allocations_;
+    }
+
+    /** Number of bytes allocated, excluding padding.
+     */
+    size_t bytes() const {
+        return bytes_;
+    }
+
+    /** Number of chunks, i.e. of actual heap allocations made by the arena.
+     */
+    size_t chunks() const {
+        return chunks_.size();
+    }
+
+private:
+    static constexpr size_t CHUNK_SIZE = 64 * 1024;
+
+    std::vector<std::unique_ptr<char[]>> chunks_;
+    char * pos_;
+    size_t remaining_;
+    size_t allocations_;
+    size_t bytes_;
+};
+
+/** Standard allocator over an arena, so that containers can keep their elements in it.
+
+    Deallocation does nothing, memory of a container that grows is only reclaimed with the whole arena.
+ */
+template<typename T>
+class ArenaAllocator {
+public:
+    typedef T value_type;
+
+    ArenaAllocator(Arena & arena):
+        arena_(&arena) {
+    }
+
+    template<typename U>
+    ArenaAllocator(ArenaAllocator<U> const & other):
+        arena_(other.arena_) {
+    }
+
+    T * allocate(size_t n) {
+        return static_cast<T *>(arena_->allocate(n * sizeof(T), alignof(T)));
+    }
+
+    void deallocate(T *, size_t) {
+    }
+
+    template<typename U>
+    bool operator == (ArenaAllocator<U> const & other) const {
+        return arena_ == other.arena_;
+    }
+
+    template<typename U>
+    bool operator != (ArenaAllocator<U> const & other) const {
+        return arena_ != other.arena_;
+    }
+
+private:
+    template<typename U>
+    friend class ArenaAllocator;
+
+    Arena * arena_;
+};
+
+}
+
+#endif
@@ -3,6 +3,7 @@
 
 #include <iostream>
 #include <cassert>
+#include "arena.h"
 #include "scanner.h"
 
 namespace mila {
@@ -10,19 +11,67 @@ namespace ast {
 
 class Visitor;
 
+/** Kind of an AST node, identifies its class without the virtual call.
+ */
+enum class Kind : uint8_t {
+    Declaration,
+    Arguments,
+    Function,
+    Functions,
+    Declarations,
+    Module,
+    Block,
+    Write,
+    Read,
+    If,
+    While,
+    Return,
+    Assignment,
+    Call,
+    Binary,
+    Unary,
+    Variable,
+    Number,
+};
+
+/** Vector of node children, kept in the AST arena.
+ */
+template<typename T>
+using List = std::vector<T, ArenaAllocator<T>>;
+
+/** Base of all AST nodes.
+
+    Nodes are allocated in the arena of the context (new (arena) Node(...)) and are never deleted individually, the whole tree is released with the arena. Their destructors are therefore never called.
+
+    Expression children of the nodes are not const so that they can be replaced by the Simplifier.
+ */
 class Node {
 public:
-    int const line;
-    int const col;
+    /** Offset of the node's token in the source, line and column are resolved through the module's context when needed.
+     */
+    uint32_t const offset;
 
-    virtual ~Node() {}
+    /** Class of the node, for StaticVisitor.
+     */
+    Kind const kind;
 
     virtual void accept(Visitor * v);
 
+    static void * operator new(size_t size, Arena & arena) {
+        return arena.allocate(size, alignof(Node));
+    }
+
+    /** Only called if a constructor throws, the memory stays in the arena.
+     */
+    static void operator delete(void *, Arena &) {
+    }
+
+    static void operator delete(void *) = delete;
+
 protected:
-    Node(Token const & t):
-        line(t.line),
-        col(t.col) {
+    Node(Kind kind, Token const & t):
+        offset(t.offset),
+        kind(kind) {
     }
 
 };
@@ -38,14 +87,12 @@ public:
     Number * const value;
 
     Declaration(Token const & t, Number * value = nullptr):
-        Node(t),
+        Node(Kind::Declaration, t),
         symbol(t.symbol()),
         value(value) {
         assert (t == Token::Type::ident);
     }
 
-    ~Declaration() override;
-
     void accept(Visitor * v) override;
 };
 
@@ -53,7 +100,7 @@ class Arguments : public Node {
 public:
 
     Arguments(Token const & t):
-        Node(t) {
+        Node(Kind::Arguments, t) {
         assert (t == Token::Type::parOpen);
     }
 
@@ -66,46 +113,42 @@ public:
 
     Symbol const name;
 
-    std::vector<Symbol> arguments;
+    List<Symbol> arguments;
 
-    Node * const body;
+    Node * body;
 
-    Function(Token t, std::vector<Symbol> && arguments, Node * body):
-        Node(t),
+    Function(Token t, List<Symbol> && arguments, Node * body):
+        Node(Kind::Function, t),
         name(t.symbol()),
-        arguments(arguments),
+        arguments(std::move(arguments)),
         body(body) {
         assert (t == Token::Type::ident);
     }
 
-    ~Function() override;
-
     void accept(Visitor * v) override;
 };
 
 class Functions : public Node {
 public:
-    std::vector<Function *> functions;
+    List<Function *> functions;
 
-    Functions(Token const & t):
-        Node(t) {
+    Functions(Token const & t, Arena & arena):
+        Node(Kind::Functions, t),
+        functions(arena) {
     }
 
-    ~Functions() override;
-
     void accept(Visitor * v) override;
 };
 
 class Declarations : public Node {
 public:
-    std::vector<Declaration *> declarations;
+    List<Declaration *> declarations;
 
-    Declarations(Token const & t):
-        Node(t) {
+    Declarations(Token const & t, Arena & arena):
+        Node(Kind::Declarations, t),
+        declarations(arena) {
     }
 
-    ~Declarations() override;
-
     void accept(Visitor * v) override;
 };
 
@@ -115,46 +158,51 @@ public:
     Declarations * const declarations;
     Block * const body;
 
-    Module(Token const & t, Functions * functions, Declarations * declarations, Block * body):
-        Node(t),
+    /** The compilation context the module's symbols belong to.
+     */
+    Context & context;
+
+    /** Set by the Simplifier, the compilers then also reduce the strength of the module's operations.
+     */
+    bool simplified;
+
+    Module(Token const & t, Context & context, Functions * functions, Declarations * declarations, Block * body):
+        Node(Kind::Module, t),
         functions(functions),
         declarations(declarations),
-        body(body) {
+        body(body),
+        context(context),
+        simplified(false) {
         assert (t == Token::Type::kwBegin);
     }
 
-    ~Module() override;
-
     void accept(Visitor * v) override;
 };
 
 class Block : public Node {
 public:
     Declarations * declarations;
-    std::vector<Node *> statements;
+    List<Node *> statements;
 
-    Block(Token const & t, Declarations * declarations):
-        Node(t),
-        declarations(declarations) {
+    Block(Token const & t, Declarations * declarations, Arena & arena):
+        Node(Kind::Block, t),
+        declarations(declarations),
+        statements(arena) {
         assert (t == Token::Type::kwBegin);
     }
 
-    ~Block() override;
-
     void accept(Visitor * v) override;
 };
 
 class Write : public Node {
 public:
-    Expression * const expression;
+    Expression * expression;
     Write(Token const & t, Expression * expression):
-        Node(t),
+        Node(Kind::Write, t),
         expression(expression) {
         assert (t == Token::Type::kwWrite);
     }
 
-    ~Write() override;
-
     void accept(Visitor * v) override;
 };
 
@@ -162,7 +210,7 @@ class Read : public Node {
 public:
     Symbol const symbol;
     Read(Token const & t, Symbol symbol):
-        Node(t),
+        Node(Kind::Read, t),
         symbol(symbol) {
         assert (t == Token::Type::kwRead);
     }
@@ -172,52 +220,46 @@ public:
 
 class If : public Node {
 public:
-    Expression * const condition;
-    Node * const trueCase;
-    Node * const falseCase;
+    Expression * condition;
+    Node * trueCase;
+    Node * falseCase;
 
     If(Token const & t, Expression * condition, Node * trueCase, Node * falseCase = nullptr):
-        Node(t),
+        Node(Kind::If, t),
         condition(condition),
         trueCase(trueCase),
         falseCase(falseCase) {
         assert (t == Token::Type::kwIf);
     }
 
-    ~If() override;
-
     void accept(Visitor * v) override;
 };
 
 class While : public Node {
 public:
-    Expression * const condition;
-    Node * const body;
+    Expression * condition;
+    Node * body;
 
     While(Token const & t, Expression * condition, Node * body):
-        Node(t),
+        Node(Kind::While, t),
         condition(condition),
         body(body) {
         assert (t == Token::Type::kwWhile);
     }
 
-    ~While() override;
-
     void accept(Visitor * v) override;
 };
 
 class Return : public Node {
 public:
-    Expression * const value;
+    Expression * value;
 
     Return(Token const & t, Expression * value = nullptr):
-        Node(t),
+        Node(Kind::Return, t),
         value(value) {
         assert (t == Token::Type::kwReturn);
     }
 
-    ~Return() override;
-
     void accept(Visitor * v) override;
 };
 
@@ -225,25 +267,23 @@ class Expression : public Node {
 public:
     void accept(Visitor * v) override;
 protected:
-    Expression(Token const & t):
-        Node(t) {
+    Expression(Kind kind, Token const & t):
+        Node(kind, t) {
     }
 };
 
 class Assignment : public Node {
 public:
     Symbol const symbol;
-    Expression * const value;
+    Expression * value;
 
     Assignment(Token const & t, Expression * value):
-        Node(t),
+        Node(Kind::Assignment, t),
         symbol(t.symbol()),
         value(value) {
         assert (t == Token::Type::ident);
     }
 
-    ~Assignment() override;
-
     void accept(Visitor * v) override;
 };
 
@@ -251,27 +291,26 @@ class Call : public Expression {
 public:
     Symbol const function;
 
-    std::vector<Expression *> arguments;
+    List<Expression *> arguments;
 
-    Call(Token const & t):
-        Expression(t),
-        function(t.symbol()) {
+    Call(Token const & t, Arena & arena):
+        Expression(Kind::Call, t),
+        function(t.symbol()),
+        arguments(arena) {
         assert (t == Token::Type::ident);
     }
 
-    ~Call() override;
-
     void accept(Visitor * v) override;
 };
 
 class Binary : public Expression {
 public:
     Token::Type const type;
-    Expression * const lhs;
-    Expression * const rhs;
+    Expression * lhs;
+    Expression * rhs;
 
     Binary(Token const & t, Expression * lhs, Expression * rhs):
-        Expression(t),
+        Expression(Kind::Binary, t),
         type(t.type),
         lhs(lhs),
         rhs(rhs) {
@@ -287,25 +326,21 @@ public:
                 t == Token::Type::opGte);
     }
 
-    ~Binary() override;
-
     void accept(Visitor * v) override;
 };
 
 class Unary : public Expression {
 public:
     Token::Type type;
-    Expression * const operand;
+    Expression * operand;
 
     Unary(Token const & t, Expression * op):
-        Expression(t),
+        Expression(Kind::Unary, t),
         type(t.type),
         operand(op) {
         assert (t == Token::Type::opAdd or t == Token::Type::opSub);
     }
 
-    ~Unary() override;
-
     void accept(Visitor * v) override;
 };
 
@@ -313,7 +348,7 @@ class Variable : public Expression {
 public:
     Symbol const symbol;
     Variable(Token const & from):
-        Expression(from),
+        Expression(Kind::Variable, from),
         symbol(from.symbol()) {
         assert(from == Token::Type::ident);
     }
@@ -325,7 +360,7 @@ class Number : public Expression {
 public:
     int const value;
     Number(Token const & from):
-        Expression(from),
+        Expression(Kind::Number, from),
         value(from.value()) {
         assert(from == Token::Type::number);
     }
@@ -418,6 +453,254 @@ protected:
 
 };
 
+/** Visitor that traverses the tree on an explicit stack instead of native recursion, so that arbitrarily deep trees can be visited in bounded native stack.
+
+    Instead of calling accept on its children, a visit method pushes them, together with itself to be resumed after them, with a step number telling where to continue. The stack is a LIFO, so the node to be resumed must be pushed before the child. The step of the node being visited is 0 when it is visited for the first time.
+ */
+class IterativeVisitor : public Visitor {
+protected:
+
+    IterativeVisitor():
+        step_(0) {
+    }
+
+    /** Visits the given node and everything it pushes.
+     */
+    void traverse(Node * root) {
+        size_t base = stack_.size();
+        push(root);
+        while (stack_.size() != base) {
+            Item i = stack_.back();
+            stack_.pop_back();
+            step_ = i.step;
+            i.node->accept(this);
+        }
+    }
+
+    void push(Node * n, uint32_t step = 0) {
+        stack_.push_back(Item{n, step});
+    }
+
+    uint32_t step() const {
+        return step_;
+    }
+
+private:
+    struct Item {
+        Node * node;
+        uint32_t step;
+    };
+
+    std::vector<Item> stack_;
+    uint32_t step_;
+};
+
+/** Visitor with static dispatch.
+
+    Instead of the virtual accept and visit calls, dispatch() switches on the kind of the node and calls the visit method of IMPL for the node's class directly, so that the call can be inlined. The visit methods need not be virtual, they are chosen by overloading, so a node without its own visit method goes to the method of its closest base class as it would with Visitor. IMPL must be a friend of the StaticVisitor if its visit methods are not public.
+ */
+template<typename IMPL, typename RESULT = void>
+class StaticVisitor {
+protected:
+
+    RESULT dispatch(Node * n) {
+        IMPL * impl = static_cast<IMPL *>(this);
+        switch (n->kind) {
+            case Kind::Declaration:
+                return impl->visit(static_cast<Declaration *>(n));
+            case Kind::Arguments:
+                return impl->visit(static_cast<Arguments *>(n));
+            case Kind::Function:
+                return impl->visit(static_cast<Function *>(n));
+            case Kind::Functions:
+                return impl->visit(static_cast<Functions *>(n));
+            case Kind::Declarations:
+                return impl->visit(static_cast<Declarations *>(n));
+            case Kind::Module:
+                return impl->visit(static_cast<Module *>(n));
+            case Kind::Block:
+                return impl->visit(static_cast<Block *>(n));
+            case Kind::Write:
+                return impl->visit(static_cast<Write *>(n));
+            case Kind::Read:
+                return impl->visit(static_cast<Read *>(n));
+            case Kind::If:
+                return impl->visit(static_cast<If *>(n));
+            case Kind::While:
+                return impl->visit(static_cast<While *>(n));
+            case Kind::Return:
+                return impl->visit(static_cast<Return *>(n));
+            case Kind::Assignment:
+                return impl->visit(static_cast<Assignment *>(n));
+            case Kind::Call:
+                return impl->visit(static_cast<Call *>(n));
+            case Kind::Binary:
+                return impl->visit(static_cast<Binary *>(n));
+            case Kind::Unary:
+                return impl->visit(static_cast<Unary *>(n));
+            case Kind::Variable:
+                return impl->visit(static_cast<Variable *>(n));
+            case Kind::Number:
+                return impl->visit(static_cast<Number *>(n));
+            default:
+                // a kind added without its case here, or a corrupted node
+                throw Exception(STR("Unknown AST node kind " << static_cast<int>(n->kind)));
+        }
+    }
+};
+
+/** Creates the pointer linked AST nodes for the parser.
+
+    Children of list nodes (functions, declarations, statements and call arguments) are collected by the parser between mark() and the creation of their parent, so that the lists are allocated with their final size.
+ */
+class Builder {
+public:
+    typedef ast::Node * Node;
+    typedef ast::Expression * Expression;
+    typedef ast::Declaration * Declaration;
+    typedef ast::Declarations * Declarations;
+    typedef ast::Function * Function;
+    typedef ast::Functions * Functions;
+    typedef ast::Block * Block;
+    typedef ast::Module * Module;
+
+    /** Position of the first child of a list being parsed.
+     */
+    struct Mark {
+        size_t nodes;
+        size_t symbols;
+    };
+
+    /** Functions can be parsed in parallel, each batch by its own builder allocating from its own arena.
+     */
+    static constexpr bool PARALLEL = true;
+
+    Builder(Context & context):
+        context_(context),
+        arena_(context.nodes) {
+    }
+
+    /** Creates builder that allocates the nodes from the given arena instead of the context's one.
+     */
+    Builder(Context & context, Arena & arena):
+        context_(context),
+        arena_(arena) {
+    }
+
+    Mark mark() const {
+        return Mark{nodes_.size(), symbols_.size()};
+    }
+
+    void push(ast::Node * node) {
+        nodes_.push_back(node);
+    }
+
+    void push(Symbol symbol) {
+        symbols_.push_back(symbol);
+    }
+
+    Module module(Token const & t, Functions functions, Declarations declarations, Block body) {
+        return new (arena_) ast::Module(t, context_, functions, declarations, body);
+    }
+
+    Functions functions(Token const & t, Mark from) {
+        ast::Functions * result = new (arena_) ast::Functions(t, arena_);
+        pop(from, result->functions);
+        return result;
+    }
+
+    Function function(Token const & name, Mark arguments, Node body) {
+        List<Symbol> args(arena_);
+        args.assign(symbols_.begin() + arguments.symbols, symbols_.end());
+        symbols_.erase(symbols_.begin() + arguments.symbols, symbols_.end());
+        return new (arena_) ast::Function(name, std::move(args), body);
+    }
+
+    Declarations declarations(Token const & t, Mark from) {
+        ast::Declarations * result = new (arena_) ast::Declarations(t, arena_);
+        pop(from, result->declarations);
+        return result;
+    }
+
+    Declaration variableDeclaration(Token const & t) {
+        return new (arena_) ast::Declaration(t);
+    }
+
+    Declaration constantDeclaration(Token const & t, Token const & value) {
+        return new (arena_) ast::Declaration(t, new (arena_) ast::Number(value));
+    }
+
+    Block block(Token const & t, Declarations declarations, Mark from) {
+        ast::Block * result = new (arena_) ast::Block(t, declarations, arena_);
+        pop(from, result->statements);
+        return result;
+    }
+
+    Node writeStatement(Token const & t, Expression expression) {
+        return new (arena_) ast::Write(t, expression);
+    }
+
+    Node readStatement(Token const & t, Symbol symbol) {
+        return new (arena_) ast::Read(t, symbol);
+    }
+
+    Node ifStatement(Token const & t, Expression condition, Node trueCase, Node falseCase) {
+        return new (arena_) ast::If(t, condition, trueCase, falseCase);
+    }
+
+    Node whileStatement(Token const & t, Expression condition, Node body) {
+        return new (arena_) ast::While(t, condition, body);
+    }
+
+    Node returnStatement(Token const & t, Expression value) {
+        return new (arena_) ast::Return(t, value);
+    }
+
+    Node assignment(Token const & t, Expression value) {
+        return new (arena_) ast::Assignment(t, value);
+    }
+
+    Expression call(Token const & t, Mark from) {
+        ast::Call * result = new (arena_) ast::Call(t, arena_);
+        pop(from, result->arguments);
+        return result;
+    }
+
+    Expression binary(Token const & t, Expression lhs, Expression rhs) {
+        return new (arena_) ast::Binary(t, lhs, rhs);
+    }
+
+    Expression unary(Token const & t, Expression operand) {
+        return new (arena_) ast::Unary(t, operand);
+    }
+
+    Expression variable(Token const & t) {
+        return new (arena_) ast::Variable(t);
+    }
+
+    Expression number(Token const & t) {
+        return new (arena_) ast::Number(t);
+    }
+
+private:
+
+    /** Moves the nodes pushed since the mark to the given list.
+     */
+    template<typename T>
+    void pop(Mark from, List<T *> & into) {
+        into.reserve(nodes_.size() - from.nodes);
+        for (size_t i = from.nodes, e = nodes_.size(); i != e; ++i)
+            into.push_back(static_cast<T *>(nodes_[i]));
+        nodes_.resize(from.nodes);
+    }
+
+    Context & context_;
+    Arena & arena_;
+
+    std::vector<ast::Node *> nodes_;
+    std::vector<Symbol> symbols_;
+};
+
 
 
 
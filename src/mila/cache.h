@@ -0,0 +1,481 @@
+#ifndef MILA_CACHE_H
+#define MILA_CACHE_H
+
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+
+#include <fstream>
+#include <iomanip>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "ast.h"
+#include "flat.h"
+
+namespace mila {
+
+/** On disk cache of parsed modules.
+
+    The flat AST of a source is stored in a file named by the hash of the source's contents, so that an unchanged source is neither scanned nor parsed again. The file is the header followed by the tree's arrays, the symbol table and a copy of the source, every array aligned to 4 bytes, so that a loaded tree uses the arrays straight from the mapped file. The only work done on load is interning the symbols in their original order, which gives them their original ids. The pointer AST is rebuilt from the flat tree in a single pass (expand()).
+
+    The hash only names the file, a hit requires the stored source to be byte for byte the same as the one being compiled, so that a collision is a miss rather than a wrong tree.
+
+    The flat parser that creates the stored trees has no parallel variant, so on a miss the source is parsed serially even when mila+ has a thread pool for the parallel parsing of the pointer linked AST.
+
+    Files of other formats are rejected by the version in their header and rewritten, VERSION must be increased whenever the layout of the file, or the trees the parser creates for a source, change. As a file could still be stale or corrupted, every loaded tree is validated before it is used (kinds, operators, symbols, child indices, lists and root all in range), a file that fails is a miss.
+ */
+class AstCache {
+public:
+    explicit AstCache(std::string const & directory):
+        directory_(directory),
+        key_(0),
+        size_(0),
+        hit_(false),
+        bytes_(0) {
+    }
+
+    /** Maps the source file into the context and returns its tree from the cache, or nullptr if the cache does not have it.
+
+        The context must be fresh, so that the symbols get the ids they had when the tree was stored.
+     */
+    flat::Tree * load(Context & context, std::string const & filename) {
+        if (context.symbols.size() != 0)
+            throw Exception("AST cache can only be loaded into a fresh context");
+        context.source = MappedFile::open(filename);
+        context.lines.reset(context.source.begin(), context.source.end());
+        key_ = hash(context.source.begin(), context.source.size());
+        size_ = context.source.size();
+        path_ = STR(directory_ << "/" << std::hex << std::setw(16) << std::setfill('0') << key_ << ".ast");
+        hit_ = false;
+        bytes_ = 0;
+        struct stat st;
+        if (stat(path_.c_str(), &st) != 0 or static_cast<size_t>(st.st_size) < sizeof(Header))
+            return nullptr;
+        MappedFile file = MappedFile::open(path_);
+        Header const & h = * reinterpret_cast<Header const *>(file.begin());
+        Layout l(h);
+        if (memcmp(h.magic, magic(), sizeof(h.magic)) != 0 or h.version != VERSION or h.hash != key_ or h.sourceSize != size_ or l.size != file.size())
+            return nullptr;
+        char const * base = file.begin();
+        if (memcmp(base + l.source, context.source.begin(), size_) != 0 or not valid(h, l, base))
+            return nullptr;
+        uint32_t const * lengths = reinterpret_cast<uint32_t const *>(base + l.lengths);
+        char const * name = base + l.names;
+        for (uint32_t i = 0; i < h.symbols; ++i) {
+            context.symbols.intern(name, lengths[i]);
+            name += lengths[i];
+        }
+        std::unique_ptr<flat::Tree> result(new flat::Tree(context));
+        result->kinds_.view(reinterpret_cast<flat::Kind const *>(base + l.kinds), h.nodes);
+        result->ops_.view(reinterpret_cast<Token::Type const *>(base + l.ops), h.nodes);
+        result->offsets_.view(reinterpret_cast<uint32_t const *>(base + l.offsets), h.nodes);
+        result->a_.view(reinterpret_cast<flat::Index const *>(base + l.a), h.nodes);
+        result->b_.view(reinterpret_cast<flat::Index const *>(base + l.b), h.nodes);
+        result->c_.view(reinterpret_cast<flat::Index const *>(base + l.c), h.nodes);
+        result->lists_.view(reinterpret_cast<flat::Index const *>(base + l.lists), h.lists);
+        result->root = h.root;
+        result->mapping_ = std::move(file);
+        hit_ = true;
+        bytes_ = l.size;
+        return result.release();
+    }
+
+    /** Stores the tree of the source last given to load().
+
+        The file is written under a temporary name and then renamed, so that concurrent compilations of the same source never see a partial file.
+     */
+    void store(flat::Tree const & tree) {
+        SymbolTable const & symbols = tree.context.symbols;
+        Header h;
+        memcpy(h.magic, magic(), sizeof(h.magic));
+        h.version = VERSION;
+        h.reserved = 0;
+        h.hash = key_;
+        h.sourceSize = size_;
+        h.nodes = tree.size();
+        h.lists = tree.lists_.size();
+        h.symbols = symbols.size();
+        h.names = 0;
+        for (size_t i = 0; i < symbols.size(); ++i)
+            h.names += symbols.length(i);
+        h.root = tree.root;
+        h.padding = 0;
+        Layout l(h);
+        if (mkdir(directory_.c_str(), 0777) != 0 and errno != EEXIST)
+            throw Exception(STR("Unable to create AST cache directory " << directory_));
+        std::string temp = STR(path_ << "." << getpid());
+        {
+            std::ofstream f(temp, std::ios::binary);
+            if (not f.is_open())
+                throw Exception(STR("Unable to write AST cache file " << temp));
+            f.write(reinterpret_cast<char const *>(&h), sizeof(h));
+            write(f, tree.kinds_.data(), h.nodes, l.kinds);
+            write(f, tree.ops_.data(), h.nodes, l.ops);
+            write(f, tree.offsets_.data(), h.nodes, l.offsets);
+            write(f, tree.a_.data(), h.nodes, l.a);
+            write(f, tree.b_.data(), h.nodes, l.b);
+            write(f, tree.c_.data(), h.nodes, l.c);
+            write(f, tree.lists_.data(), h.lists, l.lists);
+            std::vector<uint32_t> lengths;
+            for (size_t i = 0; i < symbols.size(); ++i)
+                lengths.push_back(symbols.length(i));
+            write(f, lengths.data(), lengths.size(), l.lengths);
+            for (size_t i = 0; i < symbols.size(); ++i)
+                f.write(symbols.name(i), symbols.length(i));
+            f.write(tree.context.source.begin(), h.sourceSize);
+            if (not f)
+                throw Exception(STR("Unable to write AST cache file " << temp));
+        }
+        if (rename(temp.c_str(), path_.c_str()) != 0) {
+            remove(temp.c_str());
+            throw Exception(STR("Unable to write AST cache file " << path_));
+        }
+        bytes_ = l.size;
+    }
+
+    /** Creates the pointer linked AST equal to the one the parser creates for the same source.
+
+        Nodes of the flat tree are in post order, so a single pass over them finds the children of every node already created. The list nodes (functions and declarations) have no node in the flat tree, they get the location of their parent, which is never reported.
+     */
+    static ast::Module * expand(flat::Tree const & t) {
+        typedef flat::Kind Kind;
+        Context & c = t.context;
+        Arena & arena = c.nodes;
+        std::vector<ast::Node *> nodes(t.size(), nullptr);
+        for (flat::Index n = 0, e = t.size(); n != e; ++n) {
+            Token token = tokenOf(t, n);
+            switch (t.kind(n)) {
+                case Kind::Declaration:
+                    nodes[n] = new (arena) ast::Declaration(token, t.b(n) == flat::NONE ? nullptr : static_cast<ast::Number *>(nodes[t.b(n)]));
+                    break;
+                case Kind::Function: {
+                    flat::Tree::List arguments = t.list(t.b(n));
+                    ast::List<Symbol> args(arena);
+                    args.reserve(arguments.size());
+                    for (flat::Index a : arguments)
+                        args.push_back(t.symbolOf(a));
+                    nodes[n] = new (arena) ast::Function(token, std::move(args), nodes[t.c(n)]);
+                    break;
+                }
+                case Kind::Module: {
+                    ast::Functions * functions = new (arena) ast::Functions(token, arena);
+                    fill(functions->functions, t.list(t.a(n)), nodes);
+                    nodes[n] = new (arena) ast::Module(token, c, functions, declarations(t.list(t.b(n)), token, nodes, arena), static_cast<ast::Block *>(nodes[t.c(n)]));
+                    break;
+                }
+                case Kind::Block: {
+                    ast::Block * block = new (arena) ast::Block(token, declarations(t.list(t.a(n)), token, nodes, arena), arena);
+                    fill(block->statements, t.list(t.b(n)), nodes);
+                    nodes[n] = block;
+                    break;
+                }
+                case Kind::Write:
+                    nodes[n] = new (arena) ast::Write(token, expression(nodes[t.a(n)]));
+                    break;
+                case Kind::Read:
+                    nodes[n] = new (arena) ast::Read(token, t.symbol(n));
+                    break;
+                case Kind::If:
+                    nodes[n] = new (arena) ast::If(token, expression(nodes[t.a(n)]), nodes[t.b(n)], nodes[t.c(n)]);
+                    break;
+                case Kind::While:
+                    nodes[n] = new (arena) ast::While(token, expression(nodes[t.a(n)]), nodes[t.b(n)]);
+                    break;
+                case Kind::Return:
+                    nodes[n] = new (arena) ast::Return(token, expression(nodes[t.a(n)]));
+                    break;
+                case Kind::Assignment:
+                    nodes[n] = new (arena) ast::Assignment(token, expression(nodes[t.b(n)]));
+                    break;
+                case Kind::Call: {
+                    ast::Call * call = new (arena) ast::Call(token, arena);
+                    fill(call->arguments, t.list(t.b(n)), nodes);
+                    nodes[n] = call;
+                    break;
+                }
+                case Kind::Binary:
+                    nodes[n] = new (arena) ast::Binary(token, expression(nodes[t.a(n)]), expression(nodes[t.b(n)]));
+                    break;
+                case Kind::Unary:
+                    nodes[n] = new (arena) ast::Unary(token, expression(nodes[t.a(n)]));
+                    break;
+                case Kind::Variable:
+                    nodes[n] = new (arena) ast::Variable(token);
+                    break;
+                case Kind::Number:
+                    nodes[n] = new (arena) ast::Number(token);
+                    break;
+            }
+        }
+        return static_cast<ast::Module *>(nodes[t.root]);
+    }
+
+    /** Whether the last load() found the tree in the cache.
+     */
+    bool hit() const {
+        return hit_;
+    }
+
+    /** The cache file of the source last given to load().
+     */
+    std::string const & path() const {
+        return path_;
+    }
+
+    /** Size of the cache file last loaded or stored.
+     */
+    size_t bytes() const {
+        return bytes_;
+    }
+
+    /** Hash of the source contents, 8 bytes at a time.
+     */
+    static uint64_t hash(char const * data, size_t size) {
+        uint64_t result = 0x9e3779b97f4a7c15ull ^ size;
+        size_t i = 0;
+        for (; i + 8 <= size; i += 8)
+            result = mix(result, data + i, 8);
+        return mix(result, data + i, size - i);
+    }
+
+private:
+
+    /** Identifies the cache files.
+     */
+    static char const * magic() {
+        return "milaast ";
+    }
+
+    /** Version of the format of the cache files and of the trees stored in them.
+     */
+    static constexpr uint32_t VERSION = 3;
+
+    struct Header {
+        char magic[8];
+        uint32_t version;
+        uint32_t reserved;
+        uint64_t hash;
+        uint64_t sourceSize;
+        uint32_t nodes;
+        uint32_t lists;
+        uint32_t symbols;
+        uint32_t names;
+        uint32_t root;
+        uint32_t padding;
+    };
+
+    static_assert(sizeof(flat::Kind) == 1 and sizeof(Token::Type) == 1, "Kinds and token types must be single bytes");
+
+    /** Offsets of the arrays in the cache file.
+     */
+    struct Layout {
+        size_t kinds;
+        size_t ops;
+        size_t offsets;
+        size_t a;
+        size_t b;
+        size_t c;
+        size_t lists;
+        size_t lengths;
+        size_t names;
+        size_t source;
+        size_t size;
+
+        Layout(Header const & h) {
+            kinds = sizeof(Header);
+            ops = kinds + h.nodes;
+            offsets = align(ops + h.nodes);
+            a = offsets + h.nodes * sizeof(uint32_t);
+            b = a + h.nodes * sizeof(flat::Index);
+            c = b + h.nodes * sizeof(flat::Index);
+            lists = c + h.nodes * sizeof(flat::Index);
+            lengths = lists + h.lists * sizeof(flat::Index);
+            names = lengths + h.symbols * sizeof(uint32_t);
+            source = names + h.names;
+            size = source + h.sourceSize;
+        }
+
+        static size_t align(size_t offset) {
+            return (offset + 3) & ~static_cast<size_t>(3);
+        }
+    };
+
+    /** Returns true if the tree in the file is well formed, i.e. it can be expanded and compiled without reading outside of the file.
+
+        Operators are checked to match the kinds, children to precede their parents as they do in the post order the trees are built in, which also rules out cycles, and to be of the kinds expand() casts them to.
+     */
+    static bool valid(Header const & h, Layout const & l, char const * base) {
+        typedef flat::Kind Kind;
+        typedef flat::Index Index;
+        flat::Kind const * kinds = reinterpret_cast<flat::Kind const *>(base + l.kinds);
+        Token::Type const * ops = reinterpret_cast<Token::Type const *>(base + l.ops);
+        uint32_t const * offsets = reinterpret_cast<uint32_t const *>(base + l.offsets);
+        Index const * a = reinterpret_cast<Index const *>(base + l.a);
+        Index const * b = reinterpret_cast<Index const *>(base + l.b);
+        Index const * c = reinterpret_cast<Index const *>(base + l.c);
+        Index const * lists = reinterpret_cast<Index const *>(base + l.lists);
+        uint32_t const * lengths = reinterpret_cast<uint32_t const *>(base + l.lengths);
+        uint64_t names = 0;
+        for (uint32_t i = 0; i < h.symbols; ++i)
+            names += lengths[i];
+        if (names != h.names or h.root >= h.nodes or kinds[h.root] != Kind::Module)
+            return false;
+        // the checks of the children of node n
+        Index n;
+        auto isNode = [&] (Index i) { return i < n; };
+        auto isExpression = [&] (Index i) { return i < n and kinds[i] >= Kind::Call; };
+        auto isStatement = [&] (Index i) { return i < n and kinds[i] >= Kind::Block; };
+        auto isSymbol = [&] (Index i) { return i < h.symbols; };
+        auto isList = [&] (Index i) { return i < h.lists and lists[i] < h.lists - i; };
+        auto isListOf = [&] (Index i, Kind kind) {
+            if (not isList(i))
+                return false;
+            for (Index j = i + 1, e = i + 1 + lists[i]; j != e; ++j)
+                if (not isNode(lists[j]) or kinds[lists[j]] != kind)
+                    return false;
+            return true;
+        };
+        auto isListOfExpressions = [&] (Index i) {
+            if (not isList(i))
+                return false;
+            for (Index j = i + 1, e = i + 1 + lists[i]; j != e; ++j)
+                if (not isExpression(lists[j]))
+                    return false;
+            return true;
+        };
+        auto isListOfStatements = [&] (Index i) {
+            if (not isList(i))
+                return false;
+            for (Index j = i + 1, e = i + 1 + lists[i]; j != e; ++j)
+                if (not isStatement(lists[j]))
+                    return false;
+            return true;
+        };
+        auto isListOfSymbols = [&] (Index i) {
+            if (not isList(i))
+                return false;
+            for (Index j = i + 1, e = i + 1 + lists[i]; j != e; ++j)
+                if (not isSymbol(lists[j]))
+                    return false;
+            return true;
+        };
+        for (n = 0; n != h.nodes; ++n) {
+            if (ops[n] > Token::Type::eof or offsets[n] > h.sourceSize)
+                return false;
+            // the tokens of the nodes are recreated from their operators, identifiers and numbers take their symbol or value from a
+            Kind k = kinds[n];
+            bool named = k == Kind::Declaration or k == Kind::Function or k == Kind::Assignment or k == Kind::Call or k == Kind::Variable;
+            if ((ops[n] == Token::Type::ident) != named or (ops[n] == Token::Type::number) != (k == Kind::Number))
+                return false;
+            bool ok;
+            switch (k) {
+                case Kind::Declaration:
+                    ok = isSymbol(a[n]) and (b[n] == flat::NONE or (isNode(b[n]) and kinds[b[n]] == Kind::Number));
+                    break;
+                case Kind::Function:
+                    ok = isSymbol(a[n]) and isListOfSymbols(b[n]) and isStatement(c[n]);
+                    break;
+                case Kind::Module:
+                    ok = isListOf(a[n], Kind::Function) and isListOf(b[n], Kind::Declaration) and isNode(c[n]) and kinds[c[n]] == Kind::Block;
+                    break;
+                case Kind::Block:
+                    ok = isListOf(a[n], Kind::Declaration) and isListOfStatements(b[n]);
+                    break;
+                case Kind::Write:
+                case Kind::Return:
+                case Kind::Unary:
+                    ok = isExpression(a[n]);
+                    break;
+                case Kind::Read:
+                case Kind::Variable:
+                    ok = isSymbol(a[n]);
+                    break;
+                case Kind::If:
+                    ok = isExpression(a[n]) and isStatement(b[n]) and isStatement(c[n]);
+                    break;
+                case Kind::While:
+                    ok = isExpression(a[n]) and isStatement(b[n]);
+                    break;
+                case Kind::Assignment:
+                    ok = isSymbol(a[n]) and isExpression(b[n]);
+                    break;
+                case Kind::Call:
+                    ok = isSymbol(a[n]) and isListOfExpressions(b[n]);
+                    break;
+                case Kind::Binary:
+                    ok = isExpression(a[n]) and isExpression(b[n]);
+                    break;
+                case Kind::Number:
+                    ok = true;
+                    break;
+                default:
+                    ok = false;
+            }
+            if (not ok)
+                return false;
+        }
+        return true;
+    }
+
+    static uint64_t mix(uint64_t h, char const * data, size_t size) {
+        uint64_t word = 0;
+        memcpy(&word, data, size);
+        h = (h ^ word) * 0x100000001b3ull;
+        return h ^ (h >> 29);
+    }
+
+    /** Writes the array, padding the file to its offset first.
+     */
+    template<typename T>
+    static void write(std::ofstream & f, T const * data, size_t size, size_t offset) {
+        static char const zeros[4] = { 0, 0, 0, 0 };
+        f.write(zeros, offset - static_cast<size_t>(f.tellp()));
+        f.write(reinterpret_cast<char const *>(data), size * sizeof(T));
+    }
+
+    static Token tokenOf(flat::Tree const & t, flat::Index n) {
+        switch (t.op(n)) {
+            case Token::Type::ident:
+                return Token::identifier(t.context, t.symbol(n), t.offset(n));
+            case Token::Type::number:
+                return Token::number(t.context, t.value(n), t.offset(n));
+            default:
+                return Token::create(t.context, t.op(n), t.offset(n));
+        }
+    }
+
+    static ast::Expression * expression(ast::Node * n) {
+        return static_cast<ast::Expression *>(n);
+    }
+
+    template<typename T>
+    static void fill(ast::List<T *> & into, flat::Tree::List items, std::vector<ast::Node *> const & nodes) {
+        into.reserve(items.size());
+        for (flat::Index i : items)
+            into.push_back(static_cast<T *>(nodes[i]));
+    }
+
+    static ast::Declarations * declarations(flat::Tree::List items, Token const & token, std::vector<ast::Node *> const & nodes, Arena & arena) {
+        ast::Declarations * result = new (arena) ast::Declarations(token, arena);
+        fill(result->declarations, items, nodes);
+        return result;
+    }
+
+    std::string directory_;
+    std::string path_;
+    uint64_t key_;
+    size_t size_;
+    bool hit_;
+    size_t bytes_;
+};
+
+}
+
+#endif
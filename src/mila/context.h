@@ -0,0 +1,35 @@
+#ifndef MILA_CONTEXT_H
+#define MILA_CONTEXT_H
+
+#include "arena.h"
+#include "source.h"
+#include "symboltable.h"
+
+namespace mila {
+
+/** Per compilation state.
+
+    Everything the front end writes to while compiling a module lives in the context, so that independent compilations can run in parallel threads without any locking. The scanner, parser, AST and compiler of a compilation all refer to the same context, which must outlive them.
+
+    The context also owns the mapped source so that line and column of any token or AST node can be found later, e.g. when the compiler reports an error, and the arena of the AST nodes, which are all released with the context.
+ */
+class Context {
+public:
+    Context() = default;
+
+    Context(Context const &) = delete;
+
+    Context & operator = (Context const &) = delete;
+
+    SymbolTable symbols;
+
+    MappedFile source;
+
+    LineTable lines;
+
+    Arena nodes;
+};
+
+}
+
+#endif
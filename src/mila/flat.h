@@ -0,0 +1,388 @@
+#ifndef MILA_FLAT_H
+#define MILA_FLAT_H
+
+#include <cstdint>
+
+#include <memory>
+#include <vector>
+
+#include "scanner.h"
+
+namespace mila {
+
+class AstCache;
+
+namespace flat {
+
+/** Index of a node, or of a list, in the flat tree.
+ */
+typedef uint32_t Index;
+
+static Index const NONE = 0xffffffff;
+
+enum class Kind : uint8_t {
+    Declaration,
+    Function,
+    Module,
+    Block,
+    Write,
+    Read,
+    If,
+    While,
+    Return,
+    Assignment,
+    Call,
+    Binary,
+    Unary,
+    Variable,
+    Number,
+};
+
+/** Flat AST.
+
+    An alternative to the pointer linked ast::Node tree, in which the nodes are stored contiguously in struct of arrays form and refer to each other by 32 bit indices. Instead of a vtable each node has a kind tag, the walks over the tree switch on it. A node has an operator (token type of binary and unary expressions), source offset and up to three operands, whose meaning depends on the kind:
+
+    Kind            a               b                       c
+    Declaration     symbol          value (Number) or NONE
+    Function        symbol          list of argument symbols body
+    Module          list of Function  list of Declaration   body (Block)
+    Block           list of Declaration  list of statements
+    Write           expression
+    Read            symbol
+    If              condition       true case               false case
+    While           condition       body
+    Return          value
+    Assignment      symbol          value
+    Call            symbol          list of arguments
+    Binary          lhs             rhs
+    Unary           operand
+    Variable        symbol
+    Number          value
+
+    Lists are stored in a separate array as their length followed by the items.
+
+    Nodes are created in post order, children always have lower indices than their parents.
+
+    A tree is either built in memory by the parser, or its arrays are views of a mapped AST cache file (see AstCache).
+ */
+class Tree {
+public:
+
+    /** Array of the tree, either owned or a view of memory owned by the tree (the mapped cache file).
+     */
+    template<typename T>
+    class Column {
+    public:
+        Column():
+            view_(nullptr),
+            viewSize_(0) {
+        }
+
+        T const & operator [] (size_t i) const {
+            return data()[i];
+        }
+
+        T const * data() const {
+            return view_ != nullptr ? view_ : owned_.data();
+        }
+
+        size_t size() const {
+            return view_ != nullptr ? viewSize_ : owned_.size();
+        }
+
+        size_t bytes() const {
+            return view_ != nullptr ? viewSize_ * sizeof(T) : owned_.capacity() * sizeof(T);
+        }
+
+        void push_back(T const & value) {
+            owned_.push_back(value);
+        }
+
+        void append(T const * begin, T const * end) {
+            owned_.insert(owned_.end(), begin, end);
+        }
+
+        /** Makes the column a view of the given memory, it can then no longer be appended to.
+         */
+        void view(T const * data, size_t size) {
+            owned_.clear();
+            view_ = data;
+            viewSize_ = size;
+        }
+
+    private:
+        std::vector<T> owned_;
+        T const * view_;
+        size_t viewSize_;
+    };
+
+    /** View of a list of indices in the tree.
+     */
+    class List {
+    public:
+        List(Index const * begin, Index size):
+            begin_(begin),
+            size_(size) {
+        }
+
+        Index const * begin() const {
+            return begin_;
+        }
+
+        Index const * end() const {
+            return begin_ + size_;
+        }
+
+        Index size() const {
+            return size_;
+        }
+
+        bool empty() const {
+            return size_ == 0;
+        }
+
+        Index operator [] (size_t i) const {
+            return begin_[i];
+        }
+
+    private:
+        Index const * begin_;
+        Index size_;
+    };
+
+    Tree(Context & context):
+        context(context),
+        root(NONE) {
+    }
+
+    Tree(Tree const &) = delete;
+
+    Tree & operator = (Tree const &) = delete;
+
+    /** The compilation context the tree's symbols belong to.
+     */
+    Context & context;
+
+    /** The Module node.
+     */
+    Index root;
+
+    size_t size() const {
+        return kinds_.size();
+    }
+
+    Kind kind(Index n) const {
+        return kinds_[n];
+    }
+
+    Token::Type op(Index n) const {
+        return ops_[n];
+    }
+
+    uint32_t offset(Index n) const {
+        return offsets_[n];
+    }
+
+    Index a(Index n) const {
+        return a_[n];
+    }
+
+    Index b(Index n) const {
+        return b_[n];
+    }
+
+    Index c(Index n) const {
+        return c_[n];
+    }
+
+    /** Symbol of a Declaration, Function, Read, Assignment, Call or Variable node.
+     */
+    Symbol symbol(Index n) const {
+        return Symbol(context.symbols, a_[n]);
+    }
+
+    /** Symbol of the given id, e.g. item of a Function's argument list.
+     */
+    Symbol symbolOf(Index id) const {
+        return Symbol(context.symbols, id);
+    }
+
+    /** Value of a Number node.
+     */
+    int value(Index n) const {
+        return static_cast<int>(a_[n]);
+    }
+
+    List list(Index l) const {
+        return List(lists_.data() + l + 1, lists_[l]);
+    }
+
+    Index add(Kind kind, Token::Type op, uint32_t offset, Index a = NONE, Index b = NONE, Index c = NONE) {
+        kinds_.push_back(kind);
+        ops_.push_back(op);
+        offsets_.push_back(offset);
+        a_.push_back(a);
+        b_.push_back(b);
+        c_.push_back(c);
+        return kinds_.size() - 1;
+    }
+
+    Index addList(Index const * begin, Index const * end) {
+        Index result = lists_.size();
+        lists_.push_back(end - begin);
+        lists_.append(begin, end);
+        return result;
+    }
+
+    /** Bytes used by the tree.
+     */
+    size_t bytes() const {
+        return kinds_.bytes() + ops_.bytes() + offsets_.bytes() + a_.bytes() + b_.bytes() + c_.bytes() + lists_.bytes();
+    }
+
+private:
+    friend class mila::AstCache;
+
+    Column<Kind> kinds_;
+    Column<Token::Type> ops_;
+    Column<uint32_t> offsets_;
+    Column<Index> a_;
+    Column<Index> b_;
+    Column<Index> c_;
+    Column<Index> lists_;
+
+    /** The cache file the columns are mapped from, if any.
+     */
+    MappedFile mapping_;
+};
+
+/** Creates the flat AST for the parser, see ast::Builder for the interface.
+
+    Items of lists being parsed are kept on a stack and moved to the tree once the list is complete, so that every list is contiguous.
+ */
+class Builder {
+public:
+    typedef Index Node;
+    typedef Index Expression;
+    typedef Index Declaration;
+    typedef Index Declarations;
+    typedef Index Function;
+    typedef Index Functions;
+    typedef Index Block;
+    typedef Tree * Module;
+
+    typedef size_t Mark;
+
+    /** All nodes are indices into a single tree, functions are never parsed in parallel.
+     */
+    static constexpr bool PARALLEL = false;
+
+    Builder(Context & context):
+        tree_(new Tree(context)) {
+    }
+
+    Mark mark() const {
+        return stack_.size();
+    }
+
+    void push(Index node) {
+        stack_.push_back(node);
+    }
+
+    void push(Symbol symbol) {
+        stack_.push_back(symbol.id());
+    }
+
+    /** Returns the complete tree, which is then owned by the caller.
+     */
+    Module module(Token const & t, Functions functions, Declarations declarations, Block body) {
+        tree_->root = tree_->add(Kind::Module, t.type, t.offset, functions, declarations, body);
+        return tree_.release();
+    }
+
+    Functions functions(Token const &, Mark from) {
+        return pop(from);
+    }
+
+    Function function(Token const & name, Mark arguments, Node body) {
+        return tree_->add(Kind::Function, name.type, name.offset, name.symbol().id(), pop(arguments), body);
+    }
+
+    Declarations declarations(Token const &, Mark from) {
+        return pop(from);
+    }
+
+    Declaration variableDeclaration(Token const & t) {
+        return tree_->add(Kind::Declaration, t.type, t.offset, t.symbol().id());
+    }
+
+    Declaration constantDeclaration(Token const & t, Token const & value) {
+        return tree_->add(Kind::Declaration, t.type, t.offset, t.symbol().id(), number(value));
+    }
+
+    Block block(Token const & t, Declarations declarations, Mark from) {
+        return tree_->add(Kind::Block, t.type, t.offset, declarations, pop(from));
+    }
+
+    Node writeStatement(Token const & t, Expression expression) {
+        return tree_->add(Kind::Write, t.type, t.offset, expression);
+    }
+
+    Node readStatement(Token const & t, Symbol symbol) {
+        return tree_->add(Kind::Read, t.type, t.offset, symbol.id());
+    }
+
+    Node ifStatement(Token const & t, Expression condition, Node trueCase, Node falseCase) {
+        return tree_->add(Kind::If, t.type, t.offset, condition, trueCase, falseCase);
+    }
+
+    Node whileStatement(Token const & t, Expression condition, Node body) {
+        return tree_->add(Kind::While, t.type, t.offset, condition, body);
+    }
+
+    Node returnStatement(Token const & t, Expression value) {
+        return tree_->add(Kind::Return, t.type, t.offset, value);
+    }
+
+    Node assignment(Token const & t, Expression value) {
+        return tree_->add(Kind::Assignment, t.type, t.offset, t.symbol().id(), value);
+    }
+
+    Expression call(Token const & t, Mark from) {
+        return tree_->add(Kind::Call, t.type, t.offset, t.symbol().id(), pop(from));
+    }
+
+    Expression binary(Token const & t, Expression lhs, Expression rhs) {
+        return tree_->add(Kind::Binary, t.type, t.offset, lhs, rhs);
+    }
+
+    Expression unary(Token const & t, Expression operand) {
+        return tree_->add(Kind::Unary, t.type, t.offset, operand);
+    }
+
+    Expression variable(Token const & t) {
+        return tree_->add(Kind::Variable, t.type, t.offset, t.symbol().id());
+    }
+
+    Expression number(Token const & t) {
+        return tree_->add(Kind::Number, t.type, t.offset, static_cast<Index>(t.value()));
+    }
+
+private:
+
+    /** Moves the items pushed since the mark to a list in the tree.
+     */
+    Index pop(Mark from) {
+        Index result = tree_->addList(stack_.data() + from, stack_.data() + stack_.size());
+        stack_.resize(from);
+        return result;
+    }
+
+    std::unique_ptr<Tree> tree_;
+    std::vector<Index> stack_;
+};
+
+}
+}
+
+#endif
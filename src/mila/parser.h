@@ -1,10 +1,13 @@
 #ifndef MILA_PARSER_H
 #define MILA_PARSER_H
 
-#include <memory>
+#include <algorithm>
+#include <exception>
+#include <type_traits>
 
 #include "scanner.h"
 #include "ast.h"
+#include "flat.h"
 
 namespace mila {
 
@@ -12,43 +15,77 @@ namespace mila {
 class ParserError : public Exception {
 public:
     ParserError(Token::Type expected, Token const & got):
-        Exception(STR("Expected " << Token::typeToString(expected) << " but " << got << "found (line: " << got.line << ", col: " << got.col << ")")) {
+        Exception(STR("Expected " << Token::typeToString(expected) << " but " << got << "found (line: " << got.line() << ", col: " << got.col() << ")")) {
     }
 
     ParserError(std::string const & expected, Token const & got):
-        Exception(STR("Expected " << expected << " but " << got << "found (line: " << got.line << ", col: " << got.col << ")")) {
+        Exception(STR("Expected " << expected << " but " << got << "found (line: " << got.line() << ", col: " << got.col() << ")")) {
     }
 };
 
 
-class Parser {
+/** mila++ recursive descent parser.
+
+    The grammar is independent of the AST it builds, the nodes are created by the BUILDER. Parser builds the pointer linked AST (ast::Builder), FlatParser the flat one (flat::Builder).
+
+    The nesting of statements and expressions is not parsed by native recursion, but on explicit stacks of frames, each frame being the state of what would otherwise be a recursive call, so that arbitrarily deep programs can be parsed in bounded native stack. Nodes are created, and errors raised, in the same order as recursive descent would.
+
+    Given a thread pool, the functions of the module are parsed in parallel if the builder supports it (see parseFunctionsParallel()).
+ */
+template<typename BUILDER>
+class BasicParser {
 public:
-    static ast::Module * parse(Scanner & s) {
-        Parser p(s);
+    typedef typename BUILDER::Module Module;
+
+    /** Parses the module, with functions parsed in parallel if a pool is given.
+
+        The statements and expressions are parsed recursively, unless iterative is true, in which case they are parsed on explicit stacks, which is somewhat slower, but parses programs nested deeper than the native stack allows.
+     */
+    static Module parse(Scanner & s, ThreadPool * pool = nullptr, bool iterative = false) {
+        BasicParser p(s, pool, iterative);
         return p.parseModule();
     }
 
-    static ast::Module * parse(Scanner && s) {
-        Parser p(s);
+    static Module parse(Scanner && s, ThreadPool * pool = nullptr, bool iterative = false) {
+        BasicParser p(s, pool, iterative);
         return p.parseModule();
     }
 
 
 private:
+    typedef typename BUILDER::Node Node;
+    typedef typename BUILDER::Expression Expression;
+    typedef typename BUILDER::Declarations Declarations;
+    typedef typename BUILDER::Function Function;
+    typedef typename BUILDER::Functions Functions;
+    typedef typename BUILDER::Block Block;
+    typedef typename BUILDER::Mark Mark;
+
+    BasicParser(Scanner & s, ThreadPool * pool, bool iterative):
+        s(s),
+        b(s.context()),
+        pool_(pool),
+        iterative_(iterative) {
+    }
 
-    Parser(Scanner & s):
-        s(s) {
+    /** Creates parser of a batch of functions whose nodes are allocated from the given arena.
+     */
+    BasicParser(Scanner & s, Arena & arena, bool iterative):
+        s(s),
+        b(s.context(), arena),
+        pool_(nullptr),
+        iterative_(iterative) {
     }
 
-    Token const & top() {
+    Token top() {
         return s.top();
     }
 
-    Token const & pop() {
+    Token pop() {
         return s.pop();
     }
 
-    Token const & pop(Token::Type t) {
+    Token pop(Token::Type t) {
         if (top() != t)
             throw ParserError(t, top());
         return pop();
@@ -67,78 +104,143 @@ private:
 
     /** module ::= { function } { declaration } block
      */
-    ast::Module * parseModule() {
-        std::unique_ptr<ast::Functions> functions(parseFunctions());
-        std::unique_ptr<ast::Declarations> declarations(parseDeclarations());
-        return new ast::Module(top(), functions.release(), declarations.release(), parseBlock());
+    Module parseModule() {
+        Functions functions = parseFunctions();
+        Declarations declarations = parseDeclarations();
+        Token t = top();
+        return b.module(t, functions, declarations, parseBlock());
     }
 
     /** function ::= kwFunction ident '(' [ ident {, ident } ]')' statement
      */
 
-    ast::Functions * parseFunctions() {
-        std::unique_ptr<ast::Functions> result(new ast::Functions(top()));
+    Functions parseFunctions() {
+        Token t = top();
+        Mark m = b.mark();
+        if (pool_ != nullptr and top() == Token::Type::kwFunction)
+            parseFunctionsParallel(std::integral_constant<bool, BUILDER::PARALLEL>());
         while (top() == Token::Type::kwFunction)
-            result->functions.push_back(parseFunction());
-        return result.release();
+            b.push(parseFunction());
+        return b.functions(t, m);
+    }
+
+    void parseFunctionsParallel(std::false_type) {
     }
 
-    ast::Function * parseFunction() {
+    /** Parses all functions but the last one in parallel and pushes them.
+
+        Functions do not nest, so a pre-scan for the function keywords finds where each of them starts. Batches of consecutive functions are parsed on the pool, each by its own parser into its own arena, from a slice of the tokens ending with the keyword of the next batch's first function, which no statement can consume. The functions are then pushed in order. If a function does not end right before the next keyword (e.g. it is followed by the module's declarations and the keyword is a misplaced one), the functions after it are dropped and the parsing continues serially from its end, so that the functions, and the first error, are always those of the serial parse. The last function is always left to the serial parse.
+     */
+    void parseFunctionsParallel(std::true_type) {
+        std::vector<size_t> starts = s.find(Token::Type::kwFunction);
+        if (starts.empty() or pool_->size() < 2)
+            return;
+        size_t n = starts.size() - 1;
+        size_t batches = std::min(n / MIN_BATCH, pool_->size() * BATCHES_PER_THREAD);
+        if (batches < 2)
+            return;
+        std::vector<Function> functions(n);
+        std::vector<size_t> ends(n);
+        std::vector<std::exception_ptr> errors(n);
+        std::vector<Arena> arenas(batches);
+        // errors in the batches resolve their lines
+        s.context().lines.build();
+        pool_->parallelFor(batches, [&] (size_t i) {
+            size_t first = n * i / batches;
+            size_t last = n * (i + 1) / batches;
+            Scanner slice = s.slice(starts[first], starts[last]);
+            BasicParser p(slice, arenas[i], iterative_);
+            for (size_t j = first; j != last; ++j) {
+                try {
+                    functions[j] = p.parseFunction();
+                } catch (...) {
+                    errors[j] = std::current_exception();
+                    return;
+                }
+                ends[j] = starts[first] + slice.position();
+                if (ends[j] != starts[j + 1])
+                    return;
+            }
+        });
+        for (Arena & arena : arenas)
+            s.context().nodes.adopt(arena);
+        for (size_t j = 0; j != n; ++j) {
+            if (errors[j])
+                std::rethrow_exception(errors[j]);
+            b.push(functions[j]);
+            if (ends[j] != starts[j + 1]) {
+                s.seek(ends[j]);
+                return;
+            }
+        }
+        s.seek(starts[n]);
+    }
+
+    Function parseFunction() {
         pop(Token::Type::kwFunction);
-        Token const & name = pop(Token::Type::ident);
+        Token name = pop(Token::Type::ident);
         pop(Token::Type::parOpen);
-        std::vector<Symbol> arguments;
+        Mark arguments = b.mark();
         if (top() != Token::Type::parClose) {
             do {
-                arguments.push_back(pop(Token::Type::ident).symbol());
+                b.push(pop(Token::Type::ident).symbol());
             } while (condPop(Token::Type::comma));
         }
         pop(Token::Type::parClose);
-        std::unique_ptr<ast::Node> body(parseStatement());
+        Node body = parseStatement();
         // mila+ has optional semicolons
         condPop(Token::Type::semicolon);
-        return new ast::Function(name, std::move(arguments), body.release());
+        return b.function(name, arguments, body);
     }
 
     /** block ::= kwBegin { declaration } { statement } kwEnd
+
+        This is the module's block, nested blocks are parsed by parseStatement().
      */
-    ast::Block * parseBlock() {
-        Token const & t = pop(Token::Type::kwBegin);
-        std::unique_ptr<ast::Block> result(new ast::Block(t, parseDeclarations()));
-        while (not condPop(Token::Type::kwEnd)) {
-            result->statements.push_back(parseStatement());
+    Block parseBlock() {
+        Token t = pop(Token::Type::kwBegin);
+        Declarations declarations = parseDeclarations();
+        Mark m = b.mark();
+        if (not iterative_) {
+            while (not condPop(Token::Type::kwEnd))
+                b.push(parseStatement());
+        } else if (not condPop(Token::Type::kwEnd)) {
+            size_t base = statements_.size();
+            statements_.push_back(StatementFrame{StatementFrame::Body, t, Expression(), Node(), declarations, m});
+            parseStatements(base);
         }
-        return result.release();
+        return b.block(t, declarations, m);
     }
 
     /** declaration ::= kwConst ident = number { , ident = number }
                       | kwVar ident {, ident }
      */
-    ast::Declarations * parseDeclarations() {
-        std::unique_ptr<ast::Declarations> result(new ast::Declarations(top()));
+    Declarations parseDeclarations() {
+        Token t = top();
+        Mark m = b.mark();
         while (true) {
             if (condPop(Token::Type::kwVar))
-                parseVariableDeclaration(result.get());
+                parseVariableDeclaration();
             else if (condPop(Token::Type::kwConst))
-                parseConstantDeclaration(result.get());
+                parseConstantDeclaration();
             else
                 break;
         }
-        return result.release();
+        return b.declarations(t, m);
     }
 
-    void parseVariableDeclaration(ast::Declarations * into) {
+    void parseVariableDeclaration() {
         do {
-            into->declarations.push_back(new ast::Declaration(pop(Token::Type::ident)));
+            b.push(b.variableDeclaration(pop(Token::Type::ident)));
         } while (condPop(Token::Type::comma));
         condPop(Token::Type::semicolon);
     }
 
-    void parseConstantDeclaration(ast::Declarations * into) {
+    void parseConstantDeclaration() {
         do {
-            Token const & ident = pop(Token::Type::ident);
+            Token ident = pop(Token::Type::ident);
             pop(Token::Type::opEq);
-            into->declarations.push_back(new ast::Declaration(ident, new ast::Number(pop(Token::Type::number))));
+            b.push(b.constantDeclaration(ident, pop(Token::Type::number)));
         } while (condPop(Token::Type::comma));
         condPop(Token::Type::semicolon);
     }
@@ -151,175 +253,410 @@ private:
                     | block
                     | return expression
                     | expression
-     */
 
-    ast::Node * parseStatement() {
-        std::unique_ptr<ast::Node> result(parseStatement_());
+        Each statement is followed by an optional semicolon.
+     */
+    Node parseStatement() {
+        if (iterative_)
+            return parseStatements(statements_.size());
+        Node result = parseStatementRecursive();
         condPop(Token::Type::semicolon);
-        return result.release();
+        return result;
     }
 
-    ast::Node * parseStatement_() {
-        Token const & t = top();
+    Node parseStatementRecursive() {
+        Token t = top();
         switch (t.type) {
             case Token::Type::kwWrite:
                 pop();
-                return new ast::Write(t, parseExpression());
+                return b.writeStatement(t, parseExpression());
             case Token::Type::kwRead:
                 pop();
-                return new ast::Read(t, pop(Token::Type::ident).symbol());
-            case Token::Type::kwIf:
-                return parseIf();
-            case Token::Type::kwWhile:
-                return parseWhile();
-            case Token::Type::kwBegin:
-                return parseBlock();
+                return b.readStatement(t, pop(Token::Type::ident).symbol());
+            case Token::Type::kwIf: {
+                pop();
+                Expression cond = parseExpression();
+                pop(Token::Type::kwThen);
+                Node trueCase = parseStatement();
+                if (condPop(Token::Type::kwElse))
+                    return b.ifStatement(t, cond, trueCase, parseStatement());
+                return b.ifStatement(t, cond, trueCase, b.number(Token::number(s.context(), 0, t.offset)));
+            }
+            case Token::Type::kwWhile: {
+                pop();
+                Expression cond = parseExpression();
+                pop(Token::Type::kwDo);
+                return b.whileStatement(t, cond, parseStatement());
+            }
+            case Token::Type::kwBegin: {
+                pop();
+                Declarations declarations = parseDeclarations();
+                Mark m = b.mark();
+                while (not condPop(Token::Type::kwEnd))
+                    b.push(parseStatement());
+                return b.block(t, declarations, m);
+            }
             case Token::Type::kwReturn:
                 pop();
-                return new ast::Return(t, parseExpression());
+                return b.returnStatement(t, parseExpression());
             case Token::Type::ident: {
-                Token const & t = pop();
-                if (condPop(Token::Type::opAssign)) {
-                    return new ast::Assignment(t, parseExpression());
-                } else {
-                    revert();
-                    return parseExpression();
-                }
+                Token t = pop();
+                if (condPop(Token::Type::opAssign))
+                    return b.assignment(t, parseExpression());
+                revert();
+                return parseExpression();
             }
             default:
                 return parseExpression();
         }
     }
 
-    ast::If * parseIf() {
-        Token const & t = pop(Token::Type::kwIf);
-        std::unique_ptr<ast::Expression> cond(parseExpression());
-        pop(Token::Type::kwThen);
-        std::unique_ptr<ast::Node> trueCase(parseStatement());
-        if (condPop(Token::Type::kwElse)) {
-            return new ast::If(t, cond.release(), trueCase.release(), parseStatement());
-        }
-        else
-            return new ast::If(t, cond.release(), trueCase.release(), new ast::Number(Token::number(0, 0, 0)));
-    }
+    /** Parses statements until the statements stack is back at the given size.
 
-    ast::While * parseWhile() {
-        Token const & t = pop(Token::Type::kwWhile);
-        std::unique_ptr<ast::Expression> cond(parseExpression());
-        pop(Token::Type::kwDo);
-        return new ast::While(t, cond.release(), parseStatement());
-    }
-
-    /** expression ::= E1 { (= | <> | < | > | <= | >= ) E1 }
+        This is the iterative variant of parseStatement(). Compound statements push their frame and continue with their first nested statement, every completed statement is then returned to the frames until one of them needs another nested statement. The module's block ends the parsing without creating the block.
      */
-    ast::Expression * parseExpression() {
-        std::unique_ptr<ast::Expression> result(parseE1());
+    Node parseStatements(size_t base) {
+        Node result;
         while (true) {
-            Token const & t = top();
-            if (t == Token::Type::opEq or t == Token::Type::opNeq or t == Token::Type::opLt or t == Token::Type::opGt or t == Token::Type::opLte or t == Token::Type::opGte) {
-                pop();
-                std::unique_ptr<ast::Expression> x(parseE1());
-                result.reset(new ast::Binary(t, result.release(), x.release()));
-            } else {
-                break;
+            if (not parseStatementStart(result))
+                continue;
+            while (true) {
+                condPop(Token::Type::semicolon);
+                if (statements_.size() == base)
+                    return result;
+                StatementFrame & f = statements_.back();
+                if (f.kind == StatementFrame::Block or f.kind == StatementFrame::Body) {
+                    b.push(result);
+                    if (not condPop(Token::Type::kwEnd))
+                        break;
+                    if (f.kind == StatementFrame::Body) {
+                        statements_.pop_back();
+                        return Node();
+                    }
+                    result = b.block(f.token, f.declarations, f.mark);
+                } else if (f.kind == StatementFrame::TrueCase) {
+                    if (condPop(Token::Type::kwElse)) {
+                        f.kind = StatementFrame::FalseCase;
+                        f.trueCase = result;
+                        break;
+                    }
+                    result = b.ifStatement(f.token, f.condition, result, b.number(Token::number(s.context(), 0, f.token.offset)));
+                } else if (f.kind == StatementFrame::FalseCase) {
+                    result = b.ifStatement(f.token, f.condition, f.trueCase, result);
+                } else {
+                    result = b.whileStatement(f.token, f.condition, result);
+                }
+                statements_.pop_back();
             }
         }
-        return result.release();
     }
 
-    /** E1 ::= E2 { ( + | - ) E2 }
+    /** Parses a simple statement into result and returns true, or pushes the frame of a compound statement and returns false.
      */
-    ast::Expression * parseE1() {
-        std::unique_ptr<ast::Expression> result(parseE2());
-        while (true) {
-            Token const & t = top();
-            if (t == Token::Type::opAdd or t == Token::Type::opSub) {
+    bool parseStatementStart(Node & result) {
+        Token t = top();
+        switch (t.type) {
+            case Token::Type::kwWrite:
                 pop();
-                std::unique_ptr<ast::Expression> x(parseE2());
-                result.reset(new ast::Binary(t, result.release(), x.release()));
-            } else {
-                break;
+                result = b.writeStatement(t, parseExpression());
+                return true;
+            case Token::Type::kwRead:
+                pop();
+                result = b.readStatement(t, pop(Token::Type::ident).symbol());
+                return true;
+            case Token::Type::kwIf: {
+                pop();
+                Expression cond = parseExpression();
+                pop(Token::Type::kwThen);
+                statements_.push_back(StatementFrame{StatementFrame::TrueCase, t, cond, Node(), Declarations(), Mark()});
+                return false;
             }
+            case Token::Type::kwWhile: {
+                pop();
+                Expression cond = parseExpression();
+                pop(Token::Type::kwDo);
+                statements_.push_back(StatementFrame{StatementFrame::While, t, cond, Node(), Declarations(), Mark()});
+                return false;
+            }
+            case Token::Type::kwBegin: {
+                pop();
+                Declarations declarations = parseDeclarations();
+                Mark m = b.mark();
+                if (condPop(Token::Type::kwEnd)) {
+                    result = b.block(t, declarations, m);
+                    return true;
+                }
+                statements_.push_back(StatementFrame{StatementFrame::Block, t, Expression(), Node(), declarations, m});
+                return false;
+            }
+            case Token::Type::kwReturn:
+                pop();
+                result = b.returnStatement(t, parseExpression());
+                return true;
+            case Token::Type::ident: {
+                Token t = pop();
+                if (condPop(Token::Type::opAssign)) {
+                    result = b.assignment(t, parseExpression());
+                } else {
+                    revert();
+                    result = parseExpression();
+                }
+                return true;
+            }
+            default:
+                result = parseExpression();
+                return true;
         }
-        return result.release();
     }
 
-    /** E2 ::= E3 { ( * | / ) E3 }
+    /** expression ::= operand { binop operand }
+
+        Binary operators are parsed by precedence climbing, the loop consumes all operators of at least the given precedence, the right operand of each being parsed with its precedence raised by one, which makes all operators left associative. The depth of calls for a primary expression no longer grows with the number of precedence levels, new operators only need an entry in the precedence table.
+
+        operand ::= + operand
+                  | - operand
+                  | ident
+                  | number
+                  | '(' expression ')'
+                  | call
+
+        call ::= ident '(' [ expession { , expression } ] ')'
+
+        The climbing is recursive by default. In the iterative parser it is done on an explicit stack instead (parseExpressionIterative()). Each binary operator waiting for its right operand, unary operator, parenthesis and call being parsed has its frame on the expressions stack, the operands themselves are parsed directly in the loop. Once an operand is complete, the unary operators before it are applied and the binary operators of at least the precedence of the next token are reduced, in the same order in which the recursive climbing would return.
      */
-    ast::Expression * parseE2() {
-        std::unique_ptr<ast::Expression> result(parseE3());
-        while (true) {
-            Token const & t = top();
-            if (t == Token::Type::opMul or t == Token::Type::opDiv) {
-                pop();
-                std::unique_ptr<ast::Expression> x(parseE3());
-                result.reset(new ast::Binary(t, result.release(), x.release()));
-            } else {
-                break;
-            }
-        }
-        return result.release();
+    Expression parseExpression() {
+        if (iterative_)
+            return parseExpressionIterative();
+        return parseBinary(1);
     }
 
-    /** E3 ::= { + | - } factor
+    /** Parses the operators of at least the given precedence and their operands.
      */
-    ast::Expression * parseE3() {
-        Token const & t = top();
-        if (t == Token::Type::opAdd) {
-            pop();
-            return new ast::Unary(t, parseE3());
-        } else if (t == Token::Type::opSub) {
+    Expression parseBinary(uint8_t minPrecedence) {
+        Expression result = parseOperand();
+        while (true) {
+            Token t = top();
+            uint8_t p = precedence(t.type);
+            if (p < minPrecedence)
+                break;
             pop();
-            return new ast::Unary(t, parseE3());
-        } else {
-            return parseFactor();
+            result = b.binary(t, result, parseBinary(p + 1));
         }
+        return result;
     }
 
-    /** factor ::= ident
-                 | number
-                 | '(' expression ')'
-                 | call
-     */
-    ast::Expression * parseFactor() {
-        switch (top().type) {
+    Expression parseOperand() {
+        Token t = top();
+        switch (t.type) {
+            case Token::Type::opAdd:
+            case Token::Type::opSub:
+                pop();
+                return b.unary(t, parseOperand());
             case Token::Type::parOpen: {
                 pop();
-                std::unique_ptr<ast::Expression> result(parseExpression());
+                Expression result = parseBinary(1);
                 pop(Token::Type::parClose);
-                return result.release();
+                return result;
             }
             case Token::Type::number:
-                return new ast::Number(pop());
-            case Token::Type::ident: {
-                Token const & t = pop();
+                return b.number(pop());
+            case Token::Type::ident:
+                pop();
                 if (condPop(Token::Type::parOpen))
                     return parseCall(t);
-                else
-                    return new ast::Variable(t);
-            }
+                return b.variable(t);
             default:
-                throw ParserError("identifier, call, number or (expression)", top());
+                throw ParserError("identifier, call, number or (expression)", t);
         }
     }
 
-    /** call ::= ident '(' [ expession { , expression } ] ')'
-     */
-    ast::Call * parseCall(Token const & function) {
+    Expression parseCall(Token const & function) {
         // ( has already been popped
-        std::unique_ptr<ast::Call> result(new ast::Call(function));
+        Mark m = b.mark();
         if (top() != Token::Type::parClose) {
             do {
-                result->arguments.push_back(parseExpression());
+                b.push(parseBinary(1));
             } while (condPop(Token::Type::comma));
         }
         pop(Token::Type::parClose);
-        return result.release();
+        return b.call(function, m);
+    }
+
+    Expression parseExpressionIterative() {
+        size_t base = expressions_.size();
+        Expression result;
+        while (true) {
+            Token t = top();
+            switch (t.type) {
+                case Token::Type::opAdd:
+                case Token::Type::opSub:
+                    pop();
+                    expressions_.push_back(ExpressionFrame{t, Expression(), ExpressionFrame::Unary, 0});
+                    continue;
+                case Token::Type::parOpen:
+                    pop();
+                    expressions_.push_back(ExpressionFrame{t, Expression(), ExpressionFrame::Parenthesis, 0});
+                    continue;
+                case Token::Type::number:
+                    result = b.number(pop());
+                    break;
+                case Token::Type::ident:
+                    pop();
+                    if (condPop(Token::Type::parOpen)) {
+                        // ( has already been popped
+                        Mark m = b.mark();
+                        if (top() != Token::Type::parClose) {
+                            expressions_.push_back(ExpressionFrame{t, Expression(), ExpressionFrame::Call, 0});
+                            calls_.push_back(m);
+                            continue;
+                        }
+                        pop(Token::Type::parClose);
+                        result = b.call(t, m);
+                    } else {
+                        result = b.variable(t);
+                    }
+                    break;
+                default:
+                    throw ParserError("identifier, call, number or (expression)", t);
+            }
+            while (true) {
+                Token op = top();
+                uint8_t p = precedence(op.type);
+                while (expressions_.size() != base) {
+                    ExpressionFrame & f = expressions_.back();
+                    if (f.kind == ExpressionFrame::Unary)
+                        result = b.unary(f.token, result);
+                    else if (f.kind == ExpressionFrame::Binary and p < f.precedence)
+                        result = b.binary(f.token, f.lhs, result);
+                    else
+                        break;
+                    expressions_.pop_back();
+                }
+                if (p > 0) {
+                    pop();
+                    expressions_.push_back(ExpressionFrame{op, result, ExpressionFrame::Binary, static_cast<uint8_t>(p + 1)});
+                    break;
+                }
+                if (expressions_.size() == base)
+                    return result;
+                ExpressionFrame & f = expressions_.back();
+                if (f.kind == ExpressionFrame::Parenthesis) {
+                    pop(Token::Type::parClose);
+                } else {
+                    b.push(result);
+                    if (condPop(Token::Type::comma))
+                        break;
+                    pop(Token::Type::parClose);
+                    result = b.call(f.token, calls_.back());
+                    calls_.pop_back();
+                }
+                expressions_.pop_back();
+            }
+        }
+    }
+
+    /** Returns the precedence of the binary operator, higher binds tighter, or 0 if the token is not a binary operator.
+     */
+    static uint8_t precedence(Token::Type t) {
+        static uint8_t const table[] = {
+            0, // ident
+            0, // number
+            2, // opAdd
+            2, // opSub
+            3, // opMul
+            3, // opDiv
+            1, // opLt
+            1, // opGt
+            1, // opLte
+            1, // opGte
+            1, // opEq
+            1, // opNeq
+            0, // opAssign
+            0, // parOpen
+            0, // parClose
+            0, // comma
+            0, // colon
+            0, // semicolon
+            0, // kwVar
+            0, // kwConst
+            0, // kwBegin
+            0, // kwEnd
+            0, // kwIf
+            0, // kwThen
+            0, // kwElse
+            0, // kwWhile
+            0, // kwDo
+            0, // kwWrite
+            0, // kwRead
+            0, // kwFunction
+            0, // kwReturn
+            0, // eof
+        };
+        static_assert(sizeof(table) == static_cast<size_t>(Token::Type::eof) + 1, "Precedence table does not match token types");
+        return table[static_cast<size_t>(t)];
     }
 
+    /** State of a compound statement whose nested statement is being parsed.
+     */
+    struct StatementFrame {
+        enum Kind {
+            Block,
+            Body, // the module's block
+            TrueCase,
+            FalseCase,
+            While,
+        };
+        Kind kind;
+        Token token;
+        Expression condition;
+        Node trueCase;
+        Declarations declarations;
+        Mark mark;
+    };
+
+    /** State of an expression whose operand is being parsed.
+
+        An expression has no frame of its own, its frames are those pushed above the size of the stack when its parsing started. A Binary frame holds the operator token and its left operand, its precedence is that of the operator plus one, which is the minimal precedence of the operators in its right operand. Marks of the calls' arguments are kept on the calls stack.
+     */
+    struct ExpressionFrame {
+        enum Kind : uint8_t {
+            Binary,
+            Unary,
+            Parenthesis,
+            Call,
+        };
+        Token token;
+        typename BUILDER::Expression lhs;
+        Kind kind;
+        uint8_t precedence;
+    };
+
+    /** Smallest number of functions worth a parallel batch.
+     */
+    static constexpr size_t MIN_BATCH = 16;
+
+    /** Batches per thread of the pool, so that batches of different lengths are balanced.
+     */
+    static constexpr size_t BATCHES_PER_THREAD = 4;
+
     Scanner & s;
 
+    BUILDER b;
+
+    ThreadPool * pool_;
+
+    /** True if statements and expressions are parsed on the explicit stacks.
+     */
+    bool iterative_;
+
+    std::vector<StatementFrame> statements_;
+    std::vector<ExpressionFrame> expressions_;
+    std::vector<Mark> calls_;
 };
 
+typedef BasicParser<ast::Builder> Parser;
+
+typedef BasicParser<flat::Builder> FlatParser;
+
 }
 #endif
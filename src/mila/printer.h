@@ -1,12 +1,20 @@
 #ifndef MILA_PRINTER_H
 #define MILA_PRINTER_H
 
+#include <algorithm>
+#include <cstring>
+#include <string>
+#include <vector>
+
 #include "ast.h"
+#include "flat.h"
 
 namespace mila {
 namespace ast {
 
-class Printer : public ast::Visitor {
+/** Prints the AST, dispatching statically on the node kinds.
+ */
+class Printer : public ast::StaticVisitor<Printer> {
 public:
     static void print(Node * n) {
         print(n, std::cout);
@@ -14,10 +22,63 @@ public:
 
     static void print(Node * n, std::ostream & stream) {
         Printer p(stream);
-        n->accept(&p);
+        p.dispatch(n);
+    }
+
+    /** Prints the binary operator of the given token type, with spaces around.
+     */
+    static void binaryOperator(Token::Type type, std::ostream & stream) {
+        switch (type) {
+            case Token::Type::opAdd:
+                stream << " + ";
+                break;
+            case Token::Type::opSub:
+                stream << " - ";
+                break;
+            case Token::Type::opMul:
+                stream << " * ";
+                break;
+            case Token::Type::opDiv:
+                stream << " / ";
+                break;
+            case Token::Type::opEq:
+                stream << " = ";
+                break;
+            case Token::Type::opNeq:
+                stream << " <> ";
+                break;
+            case Token::Type::opLt:
+                stream << " < ";
+                break;
+            case Token::Type::opGt:
+                stream << " > ";
+                break;
+            case Token::Type::opLte:
+                stream << " <= ";
+                break;
+            case Token::Type::opGte:
+                stream << " >= ";
+                break;
+            default:
+                stream << " !" << Token::typeToString(type) << "! ";
+        }
+    }
+
+    static void unaryOperator(Token::Type type, std::ostream & stream) {
+        switch (type) {
+            case Token::Type::opAdd:
+                stream << " + ";
+                break;
+            case Token::Type::opSub:
+                stream << " - ";
+                break;
+            default:
+                stream << " !" << Token::typeToString(type) << "! ";
+        }
     }
 
 protected:
+    friend class ast::StaticVisitor<Printer>;
 
     Printer(std::ostream & stream):
         stream(stream) {
@@ -32,7 +93,7 @@ protected:
             stream << "var " << d->symbol << std::endl;
         } else {
             stream << "const " << d->symbol << " = ";
-            d->value->accept(this);
+            dispatch(d->value);
             stream << std::endl;
         }
     }
@@ -46,31 +107,31 @@ protected:
                 stream << ", " << f->arguments[i];
         }
         stream << ") ";
-        f->body->accept(this);
+        dispatch(f->body);
         stream << std::endl;
     }
 
     void visit(Functions * fs) {
         for (Function * f : fs->functions)
-            f->accept(this);
+            dispatch(f);
     }
 
     void visit(Declarations * ds) {
         for (ast::Declaration * d : ds->declarations)
-            d->accept(this);
+            dispatch(d);
     }
 
     void visit(Module * m) {
-        m->functions->accept(this);
-        m->declarations->accept(this);
-        m->body->accept(this);
+        dispatch(m->functions);
+        dispatch(m->declarations);
+        dispatch(m->body);
     }
 
     void visit(Block * b) {
         stream << "begin" << std::endl;
         for (Node * s : b->statements) {
             stream << "    ";
-            s->accept(this);
+            dispatch(s);
             stream << std::endl;
         }
         stream <<  "end" << std::endl;
@@ -78,7 +139,7 @@ protected:
 
     void visit(Write * w) {
         stream << "write ";
-        w->expression->accept(this);
+        dispatch(w->expression);
     }
 
     void visit(Read * r) {
@@ -87,94 +148,581 @@ protected:
 
     void visit(If * s) {
         stream << "if ";
-        s->condition->accept(this);
+        dispatch(s->condition);
         stream << " then ";
-        s->trueCase->accept(this);
+        dispatch(s->trueCase);
         stream << " else ";
-        s->falseCase->accept(this);
+        dispatch(s->falseCase);
     }
 
     void visit(While * s) {
         stream << "while ";
-        s->condition->accept(this);
+        dispatch(s->condition);
         stream << " do ";
-        s->body->accept(this);
+        dispatch(s->body);
     }
 
     void visit(Return * s) {
         stream << "return ";
         if (s->value != nullptr)
-            s->value->accept(this);
+            dispatch(s->value);
     }
 
     void visit(Assignment * a) {
         stream << a->symbol << " := ";
-        a->value->accept(this);
+        dispatch(a->value);
     }
 
     void visit(Call * c) {
         stream << c->function << "(";
         if (not c->arguments.empty()) {
-            c->arguments[0]->accept(this);
+            dispatch(c->arguments[0]);
             for (size_t i = 1, e = c->arguments.size(); i < e; ++i) {
                 stream << ", ";
-                c->arguments[i]->accept(this);
+                dispatch(c->arguments[i]);
             }
         }
         stream << ")";
     }
 
     void visit(Binary * b) {
-        b->lhs->accept(this);
-        switch (b->type) {
+        dispatch(b->lhs);
+        binaryOperator(b->type, stream);
+        dispatch(b->rhs);
+    }
+
+    void visit(Unary * u) {
+        unaryOperator(u->type, stream);
+        dispatch(u->operand);
+    }
+
+    void visit(Variable * v ) {
+        stream << v->symbol;
+    }
+
+    void visit(Number * n) {
+        stream << n->value;
+    }
+
+private:
+    std::ostream & stream;
+
+
+};
+
+/** Growable byte buffer for the printers.
+
+    With a sink stream set, the buffer is written to it in a single write whenever it is full, otherwise it grows to hold everything appended. The memory is kept when the buffer is cleared, so that a buffer reused for many prints stops allocating once it has reached its size.
+ */
+class OutputBuffer {
+public:
+    OutputBuffer(size_t capacity = DEFAULT_CAPACITY):
+        buffer_(capacity),
+        size_(0),
+        sink_(nullptr) {
+    }
+
+    /** Sets the stream the buffer is flushed to, or nullptr to keep everything in the buffer.
+     */
+    void setSink(std::ostream * sink) {
+        sink_ = sink;
+    }
+
+    void append(char const * s, size_t length) {
+        reserve(length);
+        memcpy(buffer_.data() + size_, s, length);
+        size_ += length;
+    }
+
+    void append(char const * s) {
+        append(s, strlen(s));
+    }
+
+    void append(char c) {
+        reserve(1);
+        buffer_[size_++] = c;
+    }
+
+    void append(Symbol const & symbol) {
+        append(symbol.name(), symbol.length());
+    }
+
+    /** Appends the decimal representation of the value.
+     */
+    void append(int value) {
+        char digits[12];
+        char * end = digits + sizeof(digits);
+        char * i = end;
+        uint32_t x = value < 0 ? 0u - static_cast<uint32_t>(value) : static_cast<uint32_t>(value);
+        do {
+            *--i = '0' + x % 10;
+            x /= 10;
+        } while (x != 0);
+        if (value < 0)
+            *--i = '-';
+        append(i, end - i);
+    }
+
+    /** Writes the buffered bytes to the sink and empties the buffer.
+     */
+    void flush() {
+        if (sink_ != nullptr and size_ != 0)
+            sink_->write(buffer_.data(), size_);
+        size_ = 0;
+    }
+
+    void clear() {
+        size_ = 0;
+    }
+
+    char const * data() const {
+        return buffer_.data();
+    }
+
+    size_t size() const {
+        return size_;
+    }
+
+    std::string str() const {
+        return std::string(buffer_.data(), size_);
+    }
+
+    static constexpr size_t DEFAULT_CAPACITY = 64 * 1024;
+
+private:
+
+    /** Makes room for the given number of bytes, by flushing if there is a sink, or by growing the buffer.
+     */
+    void reserve(size_t length) {
+        if (size_ + length <= buffer_.size())
+            return;
+        if (sink_ != nullptr) {
+            flush();
+            if (length <= buffer_.size())
+                return;
+        }
+        buffer_.resize(std::max(buffer_.size() * 2, size_ + length));
+    }
+
+    std::vector<char> buffer_;
+    size_t size_;
+    std::ostream * sink_;
+};
+
+/** Printer rendering into an OutputBuffer instead of writing each fragment to a stream.
+
+    In the default mode its output is identical to that of Printer. The compact mode prints the whole tree on a single line, with the statements and declarations separated by semicolons.
+ */
+class BufferedPrinter : public ast::StaticVisitor<BufferedPrinter> {
+public:
+    static void print(Node * n, bool compact = false) {
+        print(n, std::cout, compact);
+    }
+
+    /** Prints to the stream through a buffer kept by the thread between the calls.
+     */
+    static void print(Node * n, std::ostream & stream, bool compact = false) {
+        static thread_local OutputBuffer buffer;
+        buffer.clear();
+        buffer.setSink(& stream);
+        print(n, buffer, compact);
+        buffer.flush();
+        buffer.setSink(nullptr);
+        // like the std::endl of Printer, so that the output is not overtaken by LLVM's own stream writing to the same file
+        stream.flush();
+    }
+
+    /** Renders the node into the buffer, which is not flushed.
+     */
+    static void print(Node * n, OutputBuffer & buffer, bool compact = false) {
+        BufferedPrinter p(buffer, compact);
+        p.dispatch(n);
+        if (compact)
+            buffer.append('\n');
+    }
+
+    static void binaryOperator(Token::Type type, OutputBuffer & buffer) {
+        switch (type) {
             case Token::Type::opAdd:
-                stream << " + ";
+                buffer.append(" + ", 3);
                 break;
             case Token::Type::opSub:
-                stream << " - ";
+                buffer.append(" - ", 3);
                 break;
             case Token::Type::opMul:
-                stream << " * ";
+                buffer.append(" * ", 3);
                 break;
             case Token::Type::opDiv:
-                stream << " / ";
+                buffer.append(" / ", 3);
                 break;
             case Token::Type::opEq:
-                stream << " = ";
+                buffer.append(" = ", 3);
                 break;
             case Token::Type::opNeq:
-                stream << " <> ";
+                buffer.append(" <> ", 4);
                 break;
             case Token::Type::opLt:
-                stream << " < ";
+                buffer.append(" < ", 3);
                 break;
             case Token::Type::opGt:
-                stream << " > ";
+                buffer.append(" > ", 3);
                 break;
             case Token::Type::opLte:
-                stream << " <= ";
+                buffer.append(" <= ", 4);
                 break;
             case Token::Type::opGte:
-                stream << " >= ";
+                buffer.append(" >= ", 4);
                 break;
             default:
-                stream << " !" << Token::typeToString(b->type) << "! ";
+                unknownOperator(type, buffer);
         }
-        b->rhs->accept(this);
     }
 
-    void visit(Unary * u) {
-        switch (u->type) {
+    static void unaryOperator(Token::Type type, OutputBuffer & buffer) {
+        switch (type) {
             case Token::Type::opAdd:
-                stream << " + ";
+                buffer.append(" + ", 3);
                 break;
             case Token::Type::opSub:
-                stream << " - ";
+                buffer.append(" - ", 3);
                 break;
             default:
-                stream << " !" << Token::typeToString(u->type) << "! ";
+                unknownOperator(type, buffer);
+        }
+    }
+
+protected:
+    friend class ast::StaticVisitor<BufferedPrinter>;
+
+    BufferedPrinter(OutputBuffer & buffer, bool compact):
+        b_(buffer),
+        compact_(compact) {
+    }
+
+    static void unknownOperator(Token::Type type, OutputBuffer & buffer) {
+        buffer.append(" !", 2);
+        buffer.append(Token::typeToString(type));
+        buffer.append("! ", 2);
+    }
+
+    /** Ends a declaration or a top level construct, by a new line, or by a semicolon in the compact mode.
+     */
+    void end() {
+        if (compact_)
+            b_.append("; ", 2);
+        else
+            b_.append('\n');
+    }
+
+    void visit(Node * n) {
+        b_.append("!!!", 3);
+    }
+
+    void visit(Declaration * d) {
+        if (d->value == nullptr) {
+            b_.append("var ", 4);
+            b_.append(d->symbol);
+        } else {
+            b_.append("const ", 6);
+            b_.append(d->symbol);
+            b_.append(" = ", 3);
+            dispatch(d->value);
+        }
+        end();
+    }
+
+    void visit(Function * f) {
+        b_.append("function ", 9);
+        b_.append(f->name);
+        b_.append('(');
+        if (not f->arguments.empty()) {
+            b_.append(f->arguments[0]);
+            for (size_t i = 1, e = f->arguments.size(); i < e; ++i) {
+                b_.append(", ", 2);
+                b_.append(f->arguments[i]);
+            }
+        }
+        b_.append(") ", 2);
+        dispatch(f->body);
+        end();
+    }
+
+    void visit(Functions * fs) {
+        for (Function * f : fs->functions)
+            dispatch(f);
+    }
+
+    void visit(Declarations * ds) {
+        for (ast::Declaration * d : ds->declarations)
+            dispatch(d);
+    }
+
+    void visit(Module * m) {
+        dispatch(m->functions);
+        dispatch(m->declarations);
+        dispatch(m->body);
+    }
+
+    void visit(Block * b) {
+        if (compact_) {
+            b_.append("begin", 5);
+            for (size_t i = 0, e = b->statements.size(); i != e; ++i) {
+                b_.append(i == 0 ? " " : "; ", i == 0 ? 1 : 2);
+                dispatch(b->statements[i]);
+            }
+            b_.append(" end", 4);
+        } else {
+            b_.append("begin\n", 6);
+            for (Node * s : b->statements) {
+                b_.append(INDENT, INDENT_LENGTH);
+                dispatch(s);
+                b_.append('\n');
+            }
+            b_.append("end\n", 4);
         }
-        u->operand->accept(this);
+    }
+
+    void visit(Write * w) {
+        b_.append("write ", 6);
+        dispatch(w->expression);
+    }
+
+    void visit(Read * r) {
+        b_.append("read ", 5);
+        b_.append(r->symbol);
+    }
+
+    void visit(If * s) {
+        b_.append("if ", 3);
+        dispatch(s->condition);
+        b_.append(" then ", 6);
+        dispatch(s->trueCase);
+        b_.append(" else ", 6);
+        dispatch(s->falseCase);
+    }
+
+    void visit(While * s) {
+        b_.append("while ", 6);
+        dispatch(s->condition);
+        b_.append(" do ", 4);
+        dispatch(s->body);
+    }
+
+    void visit(Return * s) {
+        b_.append("return ", 7);
+        if (s->value != nullptr)
+            dispatch(s->value);
+    }
+
+    void visit(Assignment * a) {
+        b_.append(a->symbol);
+        b_.append(" := ", 4);
+        dispatch(a->value);
+    }
+
+    void visit(Call * c) {
+        b_.append(c->function);
+        b_.append('(');
+        if (not c->arguments.empty()) {
+            dispatch(c->arguments[0]);
+            for (size_t i = 1, e = c->arguments.size(); i < e; ++i) {
+                b_.append(", ", 2);
+                dispatch(c->arguments[i]);
+            }
+        }
+        b_.append(')');
+    }
+
+    void visit(Binary * b) {
+        dispatch(b->lhs);
+        binaryOperator(b->type, b_);
+        dispatch(b->rhs);
+    }
+
+    void visit(Unary * u) {
+        unaryOperator(u->type, b_);
+        dispatch(u->operand);
+    }
+
+    void visit(Variable * v ) {
+        b_.append(v->symbol);
+    }
+
+    void visit(Number * n) {
+        b_.append(n->value);
+    }
+
+private:
+    static constexpr char const * INDENT = "    ";
+    static constexpr size_t INDENT_LENGTH = 4;
+
+    OutputBuffer & b_;
+    bool compact_;
+};
+
+/** Printer on an explicit stack for arbitrarily deep trees, its output is identical to that of Printer.
+ */
+class IterativePrinter : public IterativeVisitor {
+public:
+    static void print(Node * n) {
+        print(n, std::cout);
+    }
+
+    static void print(Node * n, std::ostream & stream) {
+        IterativePrinter p(stream);
+        p.traverse(n);
+    }
+
+protected:
+
+    IterativePrinter(std::ostream & stream):
+        stream(stream) {
+    }
+
+    void visit(Node * n) {
+        stream << "!!!";
+    }
+
+    void visit(Declaration * d) {
+        if (d->value == nullptr) {
+            stream << "var " << d->symbol << std::endl;
+        } else if (step() == 0) {
+            stream << "const " << d->symbol << " = ";
+            push(d, 1);
+            push(d->value);
+        } else {
+            stream << std::endl;
+        }
+    }
+
+    void visit(Function * f) {
+        if (step() == 0) {
+            stream << "function " << f->name;
+            stream << "(";
+            if (not f->arguments.empty()) {
+                stream << f->arguments[0];
+                for (size_t i = 1, e = f->arguments.size(); i < e; ++i)
+                    stream << ", " << f->arguments[i];
+            }
+            stream << ") ";
+            push(f, 1);
+            push(f->body);
+        } else {
+            stream << std::endl;
+        }
+    }
+
+    void visit(Functions * fs) {
+        for (size_t i = fs->functions.size(); i > 0; --i)
+            push(fs->functions[i - 1]);
+    }
+
+    void visit(Declarations * ds) {
+        for (size_t i = ds->declarations.size(); i > 0; --i)
+            push(ds->declarations[i - 1]);
+    }
+
+    void visit(Module * m) {
+        push(m->body);
+        push(m->declarations);
+        push(m->functions);
+    }
+
+    /** Step i prints the i-th statement.
+     */
+    void visit(Block * b) {
+        size_t i = step();
+        if (i == 0)
+            stream << "begin" << std::endl;
+        else
+            stream << std::endl;
+        if (i < b->statements.size()) {
+            stream << "    ";
+            push(b, i + 1);
+            push(b->statements[i]);
+        } else {
+            stream <<  "end" << std::endl;
+        }
+    }
+
+    void visit(Write * w) {
+        stream << "write ";
+        push(w->expression);
+    }
+
+    void visit(Read * r) {
+        stream << "read " << r->symbol;
+    }
+
+    void visit(If * s) {
+        switch (step()) {
+            case 0:
+                stream << "if ";
+                push(s, 1);
+                push(s->condition);
+                break;
+            case 1:
+                stream << " then ";
+                push(s, 2);
+                push(s->trueCase);
+                break;
+            default:
+                stream << " else ";
+                push(s->falseCase);
+        }
+    }
+
+    void visit(While * s) {
+        if (step() == 0) {
+            stream << "while ";
+            push(s, 1);
+            push(s->condition);
+        } else {
+            stream << " do ";
+            push(s->body);
+        }
+    }
+
+    void visit(Return * s) {
+        stream << "return ";
+        if (s->value != nullptr)
+            push(s->value);
+    }
+
+    void visit(Assignment * a) {
+        stream << a->symbol << " := ";
+        push(a->value);
+    }
+
+    /** Step i prints the i-th argument.
+     */
+    void visit(Call * c) {
+        size_t i = step();
+        if (i == 0)
+            stream << c->function << "(";
+        else if (i < c->arguments.size())
+            stream << ", ";
+        if (i < c->arguments.size()) {
+            push(c, i + 1);
+            push(c->arguments[i]);
+        } else {
+            stream << ")";
+        }
+    }
+
+    void visit(Binary * b) {
+        if (step() == 0) {
+            push(b, 1);
+            push(b->lhs);
+        } else {
+            Printer::binaryOperator(b->type, stream);
+            push(b->rhs);
+        }
+    }
+
+    void visit(Unary * u) {
+        Printer::unaryOperator(u->type, stream);
+        push(u->operand);
     }
 
     void visit(Variable * v ) {
@@ -187,10 +735,190 @@ protected:
 
 private:
     std::ostream & stream;
+};
 
+}
 
-};
+namespace flat {
+
+/** Printer of the flat AST, its output is identical to that of ast::Printer.
+ */
+class Printer {
+public:
+    static void print(Tree const & t) {
+        print(t, std::cout);
+    }
+
+    static void print(Tree const & t, std::ostream & stream) {
+        Printer p(t, stream);
+        p.print(t.root);
+    }
 
+protected:
+
+    Printer(Tree const & t, std::ostream & stream):
+        t(t),
+        stream(stream) {
+    }
+
+    /** Prints the given node and its children.
+
+        The tree is walked on an explicit stack so that arbitrarily deep trees can be printed, each node on the stack has a step telling where to continue when it is resumed after its child.
+     */
+    void print(Index root) {
+        push(root);
+        while (not stack_.empty()) {
+            Index n = stack_.back().node;
+            uint32_t step = stack_.back().step;
+            stack_.pop_back();
+            switch (t.kind(n)) {
+                case Kind::Declaration:
+                    if (t.b(n) == NONE) {
+                        stream << "var " << t.symbol(n) << std::endl;
+                    } else if (step == 0) {
+                        stream << "const " << t.symbol(n) << " = ";
+                        push(n, 1, t.b(n));
+                    } else {
+                        stream << std::endl;
+                    }
+                    break;
+                case Kind::Function:
+                    if (step == 0) {
+                        stream << "function " << t.symbol(n);
+                        stream << "(";
+                        Tree::List arguments = t.list(t.b(n));
+                        if (not arguments.empty()) {
+                            stream << t.symbolOf(arguments[0]);
+                            for (size_t i = 1, e = arguments.size(); i < e; ++i)
+                                stream << ", " << t.symbolOf(arguments[i]);
+                        }
+                        stream << ") ";
+                        push(n, 1, t.c(n));
+                    } else {
+                        stream << std::endl;
+                    }
+                    break;
+                case Kind::Module:
+                    push(t.c(n));
+                    pushAll(t.b(n));
+                    pushAll(t.a(n));
+                    break;
+                case Kind::Block: {
+                    Tree::List statements = t.list(t.b(n));
+                    if (step == 0)
+                        stream << "begin" << std::endl;
+                    else
+                        stream << std::endl;
+                    if (step < statements.size()) {
+                        stream << "    ";
+                        push(n, step + 1, statements[step]);
+                    } else {
+                        stream <<  "end" << std::endl;
+                    }
+                    break;
+                }
+                case Kind::Write:
+                    stream << "write ";
+                    push(t.a(n));
+                    break;
+                case Kind::Read:
+                    stream << "read " << t.symbol(n);
+                    break;
+                case Kind::If:
+                    switch (step) {
+                        case 0:
+                            stream << "if ";
+                            push(n, 1, t.a(n));
+                            break;
+                        case 1:
+                            stream << " then ";
+                            push(n, 2, t.b(n));
+                            break;
+                        default:
+                            stream << " else ";
+                            push(t.c(n));
+                    }
+                    break;
+                case Kind::While:
+                    if (step == 0) {
+                        stream << "while ";
+                        push(n, 1, t.a(n));
+                    } else {
+                        stream << " do ";
+                        push(t.b(n));
+                    }
+                    break;
+                case Kind::Return:
+                    stream << "return ";
+                    push(t.a(n));
+                    break;
+                case Kind::Assignment:
+                    stream << t.symbol(n) << " := ";
+                    push(t.b(n));
+                    break;
+                case Kind::Call: {
+                    Tree::List arguments = t.list(t.b(n));
+                    if (step == 0)
+                        stream << t.symbol(n) << "(";
+                    else if (step < arguments.size())
+                        stream << ", ";
+                    if (step < arguments.size())
+                        push(n, step + 1, arguments[step]);
+                    else
+                        stream << ")";
+                    break;
+                }
+                case Kind::Binary:
+                    if (step == 0) {
+                        push(n, 1, t.a(n));
+                    } else {
+                        ast::Printer::binaryOperator(t.op(n), stream);
+                        push(t.b(n));
+                    }
+                    break;
+                case Kind::Unary:
+                    ast::Printer::unaryOperator(t.op(n), stream);
+                    push(t.a(n));
+                    break;
+                case Kind::Variable:
+                    stream << t.symbol(n);
+                    break;
+                case Kind::Number:
+                    stream << t.value(n);
+                    break;
+            }
+        }
+    }
+
+    void push(Index n, uint32_t step = 0) {
+        stack_.push_back(Item{n, step});
+    }
+
+    /** Pushes the node to be resumed at the given step after its child.
+     */
+    void push(Index n, uint32_t step, Index child) {
+        push(n, step);
+        push(child);
+    }
+
+    /** Pushes the items of the list so that they are printed in order.
+     */
+    void pushAll(Index list) {
+        Tree::List l = t.list(list);
+        for (size_t i = l.size(); i > 0; --i)
+            push(l[i - 1]);
+    }
+
+private:
+    struct Item {
+        Index node;
+        uint32_t step;
+    };
+
+    Tree const & t;
+    std::ostream & stream;
+    std::vector<Item> stack_;
+};
 
 }
 }
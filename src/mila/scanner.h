@@ -2,51 +2,76 @@
 #define MILA_SCANNER_H
 
 #include <cassert>
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
 
 #include <string>
 #include <map>
+#include <memory>
 #include <vector>
 #include <fstream>
 #include <sstream>
+#include <utility>
 
 #include "mila.h"
+#include "source.h"
+#include "context.h"
+#include "simd.h"
+#include "threadpool.h"
 
 namespace mila {
 
+/** Interned identifier.
+
+    The symbol remembers the table of the compilation it belongs to, symbols from different compilations must not be compared.
+ */
 class Symbol {
 public:
 
-    Symbol(std::string const & name) {
-        auto i = symbols.find(name);
-        if (i == symbols.end()) {
-            id_ = symbols.size();
-            symbols[name] = id_;
-        } else {
-            id_ = i->second;
-        }
+    Symbol(SymbolTable & table, std::string const & name):
+        table_(&table),
+        id_(table.intern(name.c_str(), name.size())) {
+    }
+
+    Symbol(SymbolTable & table, char const * name, size_t length):
+        table_(&table),
+        id_(table.intern(name, length)) {
+    }
+
+    /** Symbol of an already interned id.
+     */
+    Symbol(SymbolTable const & table, int id):
+        table_(&table),
+        id_(id) {
     }
 
     Symbol(Symbol const & other) = default;
 
     Symbol & operator = (Symbol const & other) = default;
 
-    std::string const & name() const {
-        static std::string unknown("unknown symbol");
-        for (auto i = symbols.begin(), e = symbols.end(); i != e; ++i)
-            if (i->second == id_)
-                return i->first;
-        return unknown;
+    char const * name() const {
+        return table_->name(id_);
+    }
+
+    size_t length() const {
+        return table_->length(id_);
+    }
+
+    int id() const {
+        return id_;
     }
 
     bool operator == (char const * other) const {
-        return name() == other;
+        return strcmp(name(), other) == 0;
     }
 
     bool operator != (char const * other) const {
-        return name() != other;
+        return strcmp(name(), other) != 0;
     }
 
     bool operator == (Symbol const & other) const {
+        assert(table_ == other.table_);
         return id_ == other.id_;
     }
 
@@ -54,29 +79,31 @@ public:
         return id_ != other.id_;
     }
 
-    operator char const * () const {
-        return name().c_str();
+    bool operator < (Symbol const & other) const {
+        return id_ < other.id_;
     }
 
+    operator char const * () const {
+        return name();
+    }
 
 private:
 
-    friend class Token;
 
     friend std::ostream & operator << (std::ostream & stream, Symbol const & symbol) {
         stream << symbol.name();
         return stream;
     }
 
-    int id_;
+    SymbolTable const * table_;
 
-    static std::map<std::string, int> symbols;
+    int id_;
 
 };
 
 class Token {
 public:
-    enum class Type {
+    enum class Type : uint8_t {
         ident, // identifier
         number, // integer number
         opAdd, // +
@@ -111,6 +138,70 @@ public:
         eof,
     };
 
+    /** Returns the keyword type of the given identifier, or Type::ident if the identifier is not a keyword.
+
+        Keywords are recognized by a switch on their length and first character followed by a single comparison, no lookup tables or allocations are involved.
+     */
+    static Type keyword(char const * str, size_t length) {
+        switch (length) {
+        case 2:
+            if (str[0] == 'i' and str[1] == 'f')
+                return Type::kwIf;
+            if (str[0] == 'd' and str[1] == 'o')
+                return Type::kwDo;
+            break;
+        case 3:
+            if (str[0] == 'v' and memcmp(str, "var", 3) == 0)
+                return Type::kwVar;
+            if (str[0] == 'e' and memcmp(str, "end", 3) == 0)
+                return Type::kwEnd;
+            break;
+        case 4:
+            switch (str[0]) {
+            case 't':
+                if (memcmp(str, "then", 4) == 0)
+                    return Type::kwThen;
+                break;
+            case 'e':
+                if (memcmp(str, "else", 4) == 0)
+                    return Type::kwElse;
+                break;
+            case 'r':
+                if (memcmp(str, "read", 4) == 0)
+                    return Type::kwRead;
+                break;
+            }
+            break;
+        case 5:
+            switch (str[0]) {
+            case 'c':
+                if (memcmp(str, "const", 5) == 0)
+                    return Type::kwConst;
+                break;
+            case 'b':
+                if (memcmp(str, "begin", 5) == 0)
+                    return Type::kwBegin;
+                break;
+            case 'w':
+                if (memcmp(str, "while", 5) == 0)
+                    return Type::kwWhile;
+                if (memcmp(str, "write", 5) == 0)
+                    return Type::kwWrite;
+                break;
+            }
+            break;
+        case 6:
+            if (str[0] == 'r' and memcmp(str, "return", 6) == 0)
+                return Type::kwReturn;
+            break;
+        case 8:
+            if (str[0] == 'f' and memcmp(str, "function", 8) == 0)
+                return Type::kwFunction;
+            break;
+        }
+        return Type::ident;
+    }
+
     static char const * typeToString(Type t) {
         switch (t) {
         case Type::ident:
@@ -182,35 +273,52 @@ public:
         }
     }
 
-    Type const type;
+    Type type;
 
-    int const line;
-    int const col;
+    /** Offset of the first character of the token in the source.
+     */
+    uint32_t offset;
+
+    /** Line of the token, resolved from the offset on demand.
+     */
+    int line() const {
+        int line, col;
+        context_->lines.resolve(offset, line, col);
+        return line;
+    }
+
+    /** Column of the token, resolved from the offset on demand.
+     */
+    int col() const {
+        int line, col;
+        context_->lines.resolve(offset, line, col);
+        return col;
+    }
 
     int value() const {
         assert(type == Token::Type::number);
-        return value_;
+        return static_cast<int>(payload_);
     }
 
-    Symbol const & symbol() const {
+    Symbol symbol() const {
         assert(type == Token::Type::ident);
-        return symbol_;
+        return Symbol(context_->symbols, payload_);
     }
 
-    static Token eof(int line, int col) {
-        return Token(Type::eof, 0, line, col);
+    static Token eof(Context & context, uint32_t offset) {
+        return Token(context, Type::eof, offset, 0);
     }
 
-    static Token create(Type type, int line, int col) {
-        return Token(type, 0, line, col);
+    static Token create(Context & context, Type type, uint32_t offset) {
+        return Token(context, type, offset, 0);
     }
 
-    static Token number(int value, int line, int col) {
-        return Token(Type::number, value, line, col);
+    static Token number(Context & context, int value, uint32_t offset) {
+        return Token(context, Type::number, offset, static_cast<uint32_t>(value));
     }
 
-    static Token identifier(std::string const & value, int line, int col) {
-        return Token(Type::ident, Symbol(value).id_, line, col);
+    static Token identifier(Context & context, Symbol symbol, uint32_t offset) {
+        return Token(context, Type::ident, offset, symbol.id());
     }
 
     bool operator == (Token::Type t) const {
@@ -223,19 +331,20 @@ public:
 
 
 private:
-    Token(Type type, int payload, int line, int col):
+    friend class Scanner;
+
+    Token(Context & context, Type type, uint32_t offset, uint32_t payload):
         type(type),
-        line(line),
-        col(col),
-        value_(payload) {
+        offset(offset),
+        context_(&context),
+        payload_(payload) {
     }
 
-    union {
-        int const value_;
-        Symbol const symbol_;
-    } ;
-
+    Context * context_;
 
+    /** Value of a number, or symbol id of an identifier.
+     */
+    uint32_t payload_;
 };
 
 inline std::ostream & operator << (std::ostream & stream, Token const & t) {
@@ -249,7 +358,7 @@ inline std::ostream & operator << (std::ostream & stream, Token const & t) {
     default:
         stream << Token::typeToString(t.type);
     }
-    stream << " (line " << t.line << ", col " << t.col << ")";
+    stream << " (line " << t.line() << ", col " << t.col() << ")";
     return stream;
 }
 
@@ -261,31 +370,77 @@ public:
 };
 
 /** mila++ scanner.
+
+    The scanner either reads its input through a std::istream (file and text), or lexes directly from a memory mapped file (map). Both give the same tokens, the mapped variant avoids the per character stream calls and builds no strings for identifiers and numbers as these are only views into the mapped buffer.
+
+    Tokens are stored packed in parallel arrays of their types, source offsets and payloads (number values or symbol ids), 9 bytes per token. Line and column are not tracked while scanning at all, they are resolved from the offset through the context's line table when an error message needs them. The mapped file is therefore owned by the context, so that a context can only be used by a single scanner.
+
+    By default the whole input is lexed when the scanner is created. A streaming scanner instead lexes tokens on demand into a small ring buffer, so that scanning overlaps with parsing and the memory used for tokens does not depend on the input size. Large mapped files can also be lexed in parallel chunks (parallel), giving the very same tokens and symbol ids as the sequential scanner.
  */
 class Scanner {
 public:
-    static Scanner file(std::string const & filename) {
-        std::ifstream s(filename);
-        if (not s.is_open())
+    static Scanner file(Context & context, std::string const & filename, bool streaming = false) {
+        std::unique_ptr<std::istream> s(new std::ifstream(filename));
+        if (not static_cast<std::ifstream *>(s.get())->is_open())
             throw Exception(STR("Unable to open file " << filename));
-        return Scanner(s);
+        context.lines.reset();
+        Scanner result(context, std::move(s), streaming);
+        result.init();
+        return result;
     }
 
-    static Scanner text(std::string const & text) {
-        std::stringstream ss(text);
-        return Scanner(ss);
+    static Scanner text(Context & context, std::string const & text, bool streaming = false) {
+        context.lines.reset();
+        Scanner result(context, std::unique_ptr<std::istream>(new std::stringstream(text)), streaming);
+        result.init();
+        return result;
+    }
+
+    static Scanner map(Context & context, std::string const & filename, bool streaming = false) {
+        mapSource(context, filename);
+        Scanner result(context, context.source.begin(), context.source.begin(), context.source.end(), streaming);
+        result.init();
+        return result;
+    }
+
+    /** Lexes the mapped file in chunks on the given thread pool.
+
+        The file is split at newlines that are outside of comments, as newlines cannot appear in any token, the chunks can be lexed independently. Each chunk is lexed into its own symbol table and the tables are then merged in the order of the chunks, so that symbol ids are assigned in the same order as by the sequential scanner. Small files are lexed sequentially.
+     */
+    static Scanner parallel(Context & context, std::string const & filename, ThreadPool & pool) {
+        mapSource(context, filename);
+        Scanner result(context, context.source.begin(), context.source.begin(), context.source.end(), false);
+        result.lexParallel(pool);
+        return result;
     }
 
+    Context & context() {
+        return *context_;
+    }
+
+    /** Number of tokens lexed so far.
+     */
     size_t size() {
-        return tokens.size();
+        return streaming ? lexed : types_.size();
+    }
+
+    /** Number of bytes the scanner uses for the tokens it keeps in memory.
+     */
+    size_t memory() {
+        return types_.capacity() * sizeof(uint8_t) + offsets_.capacity() * sizeof(uint32_t) + payloads_.capacity() * sizeof(uint32_t);
     }
 
-    Token const & top() {
-        return tokens[current];
+    Token top() {
+        if (streaming) {
+            while (current >= lexed)
+                fill();
+            return at(current % WINDOW);
+        }
+        return at(current);
     }
 
-    Token const & pop() {
-        Token const & result = top();
+    Token pop() {
+        Token result = top();
         if (result != Token::Type::eof)
             ++current;
         return result;
@@ -299,18 +454,312 @@ public:
         return top() == Token::Type::eof;
     }
 
+    /** Index of the current token.
+     */
+    size_t position() const {
+        return current;
+    }
+
+    /** Makes the token at the given index current, the scanner must not be streaming.
+     */
+    void seek(size_t position) {
+        assert(not streaming and position < types_.size());
+        current = position;
+    }
+
+    /** Returns the indices of all tokens of the given type from the current one on.
+
+        Only looks at the type bytes, so that e.g. all keywords of a kind in a large file are found at memchr speed. A streaming scanner keeps only a window of tokens and finds nothing.
+     */
+    std::vector<size_t> find(Token::Type type) const {
+        std::vector<size_t> result;
+        if (streaming)
+            return result;
+        uint8_t const * begin = types_.data();
+        uint8_t const * end = begin + types_.size();
+        for (uint8_t const * i = begin + current; i != end; ++i) {
+            i = static_cast<uint8_t const *>(memchr(i, static_cast<uint8_t>(type), end - i));
+            if (i == nullptr)
+                break;
+            result.push_back(i - begin);
+        }
+        return result;
+    }
+
+    /** Returns a scanner of the tokens from first to last (both included) followed by eof.
+
+        The tokens are copied, so that the slice can be parsed in another thread. They still belong to this scanner's context, whose symbol table and line table are then only read.
+     */
+    Scanner slice(size_t first, size_t last) const {
+        assert(not streaming and first <= last and last < types_.size());
+        Scanner result(*context_, nullptr, nullptr, nullptr, false);
+        result.types_.assign(types_.begin() + first, types_.begin() + last + 1);
+        result.offsets_.assign(offsets_.begin() + first, offsets_.begin() + last + 1);
+        result.payloads_.assign(payloads_.begin() + first, payloads_.begin() + last + 1);
+        result.types_.push_back(static_cast<uint8_t>(Token::Type::eof));
+        result.offsets_.push_back(offsets_[last]);
+        result.payloads_.push_back(0);
+        result.lexed = result.types_.size();
+        return result;
+    }
+
 private:
 
-    explicit Scanner(std::istream & input):
-        line(1),
-        col(1),
-        current(0) {
+    /** Input from a std::istream.
+
+        Newlines are recorded in the line table as they are read since the stream is not kept.
+     */
+    class StreamInput {
+    public:
+        StreamInput(std::istream * s = nullptr, LineTable * lines = nullptr):
+            s(s),
+            lines(lines),
+            offset_(0) {
+        }
+
+        char get() {
+            char result = s->get();
+            if (not s->eof()) {
+                if (result == '\n')
+                    lines->addNewline(offset_);
+                ++offset_;
+            }
+            return result;
+        }
+
+        int peek() {
+            return s->peek();
+        }
+
+        bool eof() {
+            return s->eof();
+        }
+
+        uint32_t offset() const {
+            return offset_;
+        }
+
+        std::istream * s;
+        LineTable * lines;
+        uint32_t offset_;
+    };
+
+    /** Input from a memory buffer.
+
+        Mimics the std::istream behavior, i.e. eof is only reported after an attempt to read past the end of the buffer.
+     */
+    class BufferInput {
+    public:
+        BufferInput(char const * begin = nullptr, char const * end = nullptr):
+            begin(begin),
+            pos(begin),
+            end(end),
+            eof_(false) {
+        }
+
+        char get() {
+            if (pos == end) {
+                eof_ = true;
+                return EOF;
+            }
+            return *pos++;
+        }
+
+        int peek() {
+            if (pos == end) {
+                eof_ = true;
+                return EOF;
+            }
+            return *pos;
+        }
+
+        bool eof() {
+            return eof_;
+        }
+
+        uint32_t offset() const {
+            return pos - begin;
+        }
+
+        char const * begin;
+        char const * pos;
+        char const * end;
+        bool eof_;
+    };
+
+    Scanner(Context & context, std::unique_ptr<std::istream> && input, bool streaming):
+        context_(&context),
+        stream(std::move(input)),
+        streamInput(stream.get(), &context.lines),
+        streaming(streaming),
+        current(0),
+        lexed(0) {
+    }
+
+    /** Scans the given part of the source, offsets are relative to the beginning of the source.
+     */
+    Scanner(Context & context, char const * source, char const * begin, char const * end, bool streaming):
+        context_(&context),
+        bufferInput(source, end),
+        streaming(streaming),
+        current(0),
+        lexed(0) {
+        bufferInput.pos = begin;
+    }
+
+    static void mapSource(Context & context, std::string const & filename) {
+        context.source = MappedFile::open(filename);
+        // offsets of tokens are 32 bit
+        if (context.source.size() > UINT32_MAX)
+            throw Exception(STR("File " << filename << " is too large"));
+        context.lines.reset(context.source.begin(), context.source.end());
+    }
+
+    /** Lexes the whole input, or prepares the ring buffer of a streaming scanner.
+     */
+    void init() {
+        if (streaming) {
+            types_.resize(WINDOW, static_cast<uint8_t>(Token::Type::eof));
+            offsets_.resize(WINDOW, 0);
+            payloads_.resize(WINDOW, 0);
+        } else if (stream) {
+            lex(streamInput);
+        } else {
+            lex(bufferInput);
+        }
+    }
+
+    template<typename INPUT>
+    void lex(INPUT & input) {
         while (true) {
             Token t = next(input);
-            tokens.push_back(t);
+            types_.push_back(static_cast<uint8_t>(t.type));
+            offsets_.push_back(t.offset);
+            payloads_.push_back(t.payload_);
             if (t == Token::Type::eof)
                 break;
         }
+        lexed = types_.size();
+    }
+
+    /** Returns whether the text ends inside a comment if it starts inside a comment or not.
+     */
+    static bool endsInComment(char const * p, char const * end, bool inComment) {
+        while (p != end) {
+            p = static_cast<char const *>(memchr(p, inComment ? '}' : '{', end - p));
+            if (p == nullptr)
+                break;
+            ++p;
+            inComment = not inComment;
+        }
+        return inComment;
+    }
+
+    /** Splits the source into chunks ending with a newline outside of comments.
+
+        Candidate split points are the first newlines after evenly spaced positions. Whether a candidate is inside a comment depends on all text before it, so for each part between the candidates the state at its end is computed for both possible states at its start in parallel, and the actual states are then chained in order. Candidates inside comments are dropped.
+     */
+    std::vector<char const *> split(ThreadPool & pool, size_t parts) {
+        char const * begin = bufferInput.pos;
+        char const * end = bufferInput.end;
+        std::vector<char const *> candidates;
+        candidates.push_back(begin);
+        for (size_t i = 1; i < parts; ++i) {
+            char const * p = begin + (end - begin) * i / parts;
+            if (p < candidates.back())
+                continue;
+            p = static_cast<char const *>(memchr(p, '\n', end - p));
+            if (p == nullptr)
+                break;
+            if (p + 1 != end)
+                candidates.push_back(p + 1);
+        }
+        candidates.push_back(end);
+        size_t n = candidates.size() - 1;
+        std::vector<char> fromCode(n), fromComment(n);
+        pool.parallelFor(n, [&] (size_t i) {
+            fromCode[i] = endsInComment(candidates[i], candidates[i + 1], false);
+            fromComment[i] = endsInComment(candidates[i], candidates[i + 1], true);
+        });
+        std::vector<char const *> result;
+        result.push_back(begin);
+        bool inComment = false;
+        for (size_t i = 0; i < n; ++i) {
+            if (i > 0 and not inComment)
+                result.push_back(candidates[i]);
+            inComment = inComment ? fromComment[i] : fromCode[i];
+        }
+        result.push_back(end);
+        return result;
+    }
+
+    /** Lexes the source in parallel chunks and stitches their tokens together.
+
+        Every chunk has its own context, so that the symbol tables are not shared between threads. The context's line table resolves errors in the chunk against the whole source, so that errors are reported exactly as by the sequential scanner. Of the chunks that fail, the error of the first one is thrown.
+     */
+    void lexParallel(ThreadPool & pool) {
+        size_t parts = (bufferInput.end - bufferInput.pos) / MIN_CHUNK;
+        if (parts > pool.size())
+            parts = pool.size();
+        if (parts < 2) {
+            lex(bufferInput);
+            return;
+        }
+        std::vector<char const *> chunks = split(pool, parts);
+        size_t n = chunks.size() - 1;
+        std::vector<std::unique_ptr<Context>> contexts(n);
+        std::vector<std::unique_ptr<Scanner>> scanners(n);
+        pool.parallelFor(n, [&] (size_t i) {
+            contexts[i].reset(new Context());
+            contexts[i]->lines.reset(bufferInput.begin, bufferInput.end);
+            scanners[i].reset(new Scanner(*contexts[i], bufferInput.begin, chunks[i], chunks[i + 1], false));
+            scanners[i]->init();
+        });
+        // merge symbol tables in order and find where the tokens of each chunk go, dropping all but the last eof
+        std::vector<std::vector<uint32_t>> symbols(n);
+        std::vector<size_t> start(n + 1, 0);
+        for (size_t i = 0; i < n; ++i) {
+            SymbolTable const & local = contexts[i]->symbols;
+            symbols[i].resize(local.size());
+            for (size_t id = 0; id < local.size(); ++id)
+                symbols[i][id] = context_->symbols.intern(local.name(id), local.length(id));
+            start[i + 1] = start[i] + scanners[i]->types_.size() - (i + 1 == n ? 0 : 1);
+        }
+        types_.resize(start[n]);
+        offsets_.resize(start[n]);
+        payloads_.resize(start[n]);
+        pool.parallelFor(n, [&] (size_t i) {
+            Scanner const & s = *scanners[i];
+            for (size_t j = 0, e = start[i + 1] - start[i]; j != e; ++j) {
+                types_[start[i] + j] = s.types_[j];
+                offsets_[start[i] + j] = s.offsets_[j];
+                payloads_[start[i] + j] = s.types_[j] == static_cast<uint8_t>(Token::Type::ident) ? symbols[i][s.payloads_[j]] : s.payloads_[j];
+            }
+        });
+        lexed = types_.size();
+    }
+
+    /** Lexes next token into the ring buffer of a streaming scanner.
+
+        No token is lexed after eof because pop() never moves past it.
+     */
+    void fill() {
+        Token t = stream ? next(streamInput) : next(bufferInput);
+        size_t i = lexed % WINDOW;
+        types_[i] = static_cast<uint8_t>(t.type);
+        offsets_[i] = t.offset;
+        payloads_[i] = t.payload_;
+        ++lexed;
+    }
+
+    Token at(size_t i) {
+        return Token(*context_, static_cast<Token::Type>(types_[i]), offsets_[i], payloads_[i]);
+    }
+
+    ScannerError error(std::string const & message, uint32_t offset) {
+        int line, col;
+        context_->lines.resolve(offset, line, col);
+        return ScannerError(message, line, col);
     }
 
     bool isLetter(char c) {
@@ -325,124 +774,188 @@ private:
         return c == ' ' or c == '\t' or c == '\n' or c == '\r';
     }
 
-    char get(std::istream & input) {
-        char result = input.get();
-        if (result == '\n') {
-            col = 1;
-            line += 1;
-        } else {
-            col += 1;
-        }
-        return result;
-    }
-
-    bool condGet(std::istream & input, char what) {
+    template<typename INPUT>
+    bool condGet(INPUT & input, char what) {
         if (input.peek() == what) {
-            get(input);
+            input.get();
             return true;
         } else {
             return false;
         }
     }
 
-    Token number(std::istream & input, char t, int l, int c) {
-        int result = t - '0';
-        while (not input.eof() and isDigit(input.peek()))
-            result = result * 10 + (get(input) - '0');
-        return Token::number(result, l, c);
+    Token create(Token::Type type, uint32_t offset) {
+        return Token::create(*context_, type, offset);
     }
 
-    Token identifierOrKeyword(std::istream & input, char t, int l, int c) {
-        std::string result;
+    Token number(StreamInput & input, char t, uint32_t offset) {
+        int result = t - '0';
+        while (not input.eof() and isDigit(input.peek()))
+            result = result * 10 + (input.get() - '0');
+        return Token::number(*context_, result, offset);
+    }
+
+    /** The number is a view into the buffer, its end is found first and only then the value is computed.
+     */
+    Token number(BufferInput & input, char t, uint32_t offset) {
+        char const * start = input.pos - 1;
+        input.pos = simd::findNumberEnd(input.pos, input.end);
+        if (input.pos == input.end)
+            input.eof_ = true;
+        int result = 0;
+        for (char const * i = start; i != input.pos; ++i)
+            result = result * 10 + (*i - '0');
+        return Token::number(*context_, result, offset);
+    }
+
+    /** The identifier is collected in a reusable buffer so that no allocation is made once the buffer is large enough.
+     */
+    Token identifierOrKeyword(StreamInput & input, char t, uint32_t offset) {
+        identifier.clear();
         while (true) {
-            result += t;
+            identifier += t;
             t = input.peek();
             if (input.eof() or not (isDigit(t) or isLetter(t)))
                 break;
-            get(input);
+            input.get();
         }
-        auto i = keywords.find(result);
-        if (i == keywords.end())
-            return Token::identifier(result, l, c);
+        Token::Type type = Token::keyword(identifier.data(), identifier.size());
+        if (type == Token::Type::ident)
+            return Token::identifier(*context_, Symbol(context_->symbols, identifier.data(), identifier.size()), offset);
+        else
+            return create(type, offset);
+    }
+
+    /** The identifier is a view into the buffer.
+     */
+    Token identifierOrKeyword(BufferInput & input, char t, uint32_t offset) {
+        char const * start = input.pos - 1;
+        input.pos = simd::findIdentifierEnd(input.pos, input.end);
+        size_t length = input.pos - start;
+        if (input.pos == input.end)
+            input.eof_ = true;
+        Token::Type type = Token::keyword(start, length);
+        if (type == Token::Type::ident)
+            return Token::identifier(*context_, Symbol(context_->symbols, start, length), offset);
         else
-            return Token::create(i->second, l, c);
-    }
-
-    Token next(std::istream & input) {
-        int l = line;
-        int c = col;
-        char t = get(input);
-        // skip the whitespace and comments
-        bool skip = false;
-        while (skip or t == ' ' or t == '\n' or t == '\t' or t == '\r' or t == '{') {
-            if (t == '{')
-                skip = true;
-            if (skip and t == '}')
-                skip = false;
-            l = line;
-            c = col;
-            t = get(input);
+            return create(type, offset);
+    }
+
+    /** Skips whitespace and comments one character at a time.
+     */
+    void skip(StreamInput & input) {
+        while (true) {
+            int t = input.peek();
+            if (input.eof())
+                return;
+            if (isWhitespace(t)) {
+                input.get();
+            } else if (t == '{') {
+                while (true) {
+                    t = input.peek();
+                    if (input.eof())
+                        return;
+                    input.get();
+                    if (t == '}')
+                        break;
+                }
+            } else {
+                return;
+            }
         }
+    }
+
+    /** Skips whitespace and comments using the vectorized kernels.
+     */
+    void skip(BufferInput & input) {
+        char const * p = input.pos;
+        while (true) {
+            p = simd::skipWhitespace(p, input.end);
+            if (p == input.end or *p != '{')
+                break;
+            p = simd::findCommentEnd(p + 1, input.end);
+            if (p != input.end)
+                ++p;
+        }
+        input.pos = p;
+    }
+
+    template<typename INPUT>
+    Token next(INPUT & input) {
+        skip(input);
+        uint32_t o = input.offset();
+        char t = input.get();
         if (input.eof())
-            return Token::eof(line, col);
+            return Token::eof(*context_, o);
         switch (t) {
         case '+':
-            return Token::create(Token::Type::opAdd, l, c);
+            return create(Token::Type::opAdd, o);
         case '-':
-            return Token::create(Token::Type::opSub, l, c);
+            return create(Token::Type::opSub, o);
         case '*':
-            return Token::create(Token::Type::opMul, l, c);
+            return create(Token::Type::opMul, o);
         case '/':
-            return Token::create(Token::Type::opDiv, l, c);
+            return create(Token::Type::opDiv, o);
         case '(':
-            return Token::create(Token::Type::parOpen, l, c);
+            return create(Token::Type::parOpen, o);
         case ')':
-            return Token::create(Token::Type::parClose, l, c);
+            return create(Token::Type::parClose, o);
         case '=':
-            return Token::create(Token::Type::opEq, l, c);
+            return create(Token::Type::opEq, o);
         case ',':
-            return Token::create(Token::Type::comma, l, c);
+            return create(Token::Type::comma, o);
         case ':':
             if (condGet(input, '='))
-                return Token::create(Token::Type::opAssign, l, c);
-            return Token::create(Token::Type::colon, l, c);
+                return create(Token::Type::opAssign, o);
+            return create(Token::Type::colon, o);
         case ';':
-            return Token::create(Token::Type::semicolon, l, c);
+            return create(Token::Type::semicolon, o);
         case '<':
             if (condGet(input, '>'))
-                return Token::create(Token::Type::opNeq, l, c);
+                return create(Token::Type::opNeq, o);
             if (condGet(input, '='))
-                return Token::create(Token::Type::opLte, l, c);
-            return Token::create(Token::Type::opLt, l, c);
+                return create(Token::Type::opLte, o);
+            return create(Token::Type::opLt, o);
         case '>':
             if (condGet(input, '='))
-                return Token::create(Token::Type::opGte, l, c);
-            return Token::create(Token::Type::opGt, l, c);
+                return create(Token::Type::opGte, o);
+            return create(Token::Type::opGt, o);
          default:
             if (isDigit(t))
-                return number(input, t, l, c);
+                return number(input, t, o);
             if (isLetter(t))
-                return identifierOrKeyword(input, t, l, c);
-            throw ScannerError(STR("Unknown character " << t), l, c);
+                return identifierOrKeyword(input, t, o);
+            throw error(STR("Unknown character " << t), o);
         }
     }
 
-    int line;
-    int col;
-
-    size_t current;
+    /** Size of the ring buffer of a streaming scanner, the parser needs the current token and one to revert to.
+     */
+    static constexpr size_t WINDOW = 4;
 
-    std::vector<Token> tokens;
+    /** Smallest chunk worth lexing on a separate thread.
+     */
+    static constexpr size_t MIN_CHUNK = 256 * 1024;
 
-    static std::map<std::string, Token::Type> keywords;
-};
+    Context * context_;
 
+    std::unique_ptr<std::istream> stream;
 
+    StreamInput streamInput;
+    BufferInput bufferInput;
 
+    bool streaming;
 
+    size_t current;
+    size_t lexed;
 
-}
+    std::vector<uint8_t> types_;
+    std::vector<uint32_t> offsets_;
+    std::vector<uint32_t> payloads_;
 
+    std::string identifier;
+};
 
+}
 
 #endif
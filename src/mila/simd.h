@@ -0,0 +1,184 @@
+#ifndef MILA_SIMD_H
+#define MILA_SIMD_H
+
+#include <cstddef>
+#include <cstdint>
+
+/** Vectorized scanning kernels.
+
+    AVX2 is used when the compiler targets it (e.g. -mavx2 or -march=native), SSE2 otherwise on x86. Other platforms, or builds with MILA_NO_SIMD defined, use the scalar versions only.
+ */
+
+#if not defined(MILA_NO_SIMD) and defined(__AVX2__)
+#include <immintrin.h>
+#define MILA_SIMD_WIDTH 32
+#elif not defined(MILA_NO_SIMD) and defined(__SSE2__)
+#include <emmintrin.h>
+#define MILA_SIMD_WIDTH 16
+#else
+#define MILA_SIMD_WIDTH 0
+#endif
+
+namespace mila {
+namespace simd {
+
+inline bool isWhitespace(char c) {
+    return c == ' ' or c == '\t' or c == '\n' or c == '\r';
+}
+
+inline bool isDigit(char c) {
+    return c >= '0' and c <= '9';
+}
+
+inline bool isAlnum(char c) {
+    return isDigit(c) or (c >= 'A' and c <= 'Z') or (c >= 'a' and c <= 'z');
+}
+
+namespace scalar {
+
+inline char const * skipWhitespace(char const * p, char const * end) {
+    while (p != end and isWhitespace(*p))
+        ++p;
+    return p;
+}
+
+/** Returns the position of the closing } or end if the comment is not terminated.
+ */
+inline char const * findCommentEnd(char const * p, char const * end) {
+    while (p != end and *p != '}')
+        ++p;
+    return p;
+}
+
+inline char const * findIdentifierEnd(char const * p, char const * end) {
+    while (p != end and isAlnum(*p))
+        ++p;
+    return p;
+}
+
+inline char const * findNumberEnd(char const * p, char const * end) {
+    while (p != end and isDigit(*p))
+        ++p;
+    return p;
+}
+
+} // namespace mila::simd::scalar
+
+#if MILA_SIMD_WIDTH > 0
+
+namespace vector {
+
+#if MILA_SIMD_WIDTH == 32
+
+typedef __m256i Vector;
+
+static uint32_t const FULL = 0xffffffffu;
+
+inline Vector load(char const * p) {
+    return _mm256_loadu_si256(reinterpret_cast<__m256i const *>(p));
+}
+
+inline Vector splat(char c) {
+    return _mm256_set1_epi8(c);
+}
+
+inline uint32_t eq(Vector v, char c) {
+    return static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, splat(c))));
+}
+
+/** Mask of bytes in the inclusive range lo..hi, compared as unsigned.
+ */
+inline uint32_t range(Vector v, char lo, char hi) {
+    Vector x = _mm256_sub_epi8(v, splat(lo));
+    Vector limit = splat(hi - lo);
+    return static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_max_epu8(x, limit), limit)));
+}
+
+#else
+
+typedef __m128i Vector;
+
+static uint32_t const FULL = 0xffffu;
+
+inline Vector load(char const * p) {
+    return _mm_loadu_si128(reinterpret_cast<__m128i const *>(p));
+}
+
+inline Vector splat(char c) {
+    return _mm_set1_epi8(c);
+}
+
+inline uint32_t eq(Vector v, char c) {
+    return static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(v, splat(c))));
+}
+
+inline uint32_t range(Vector v, char lo, char hi) {
+    Vector x = _mm_sub_epi8(v, splat(lo));
+    Vector limit = splat(hi - lo);
+    return static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_max_epu8(x, limit), limit)));
+}
+
+#endif
+
+inline char const * skipWhitespace(char const * p, char const * end) {
+    while (end - p >= MILA_SIMD_WIDTH) {
+        Vector v = load(p);
+        uint32_t other = ~(eq(v, '\n') | eq(v, ' ') | eq(v, '\t') | eq(v, '\r')) & FULL;
+        if (other != 0)
+            return p + __builtin_ctz(other);
+        p += MILA_SIMD_WIDTH;
+    }
+    return scalar::skipWhitespace(p, end);
+}
+
+inline char const * findCommentEnd(char const * p, char const * end) {
+    while (end - p >= MILA_SIMD_WIDTH) {
+        uint32_t close = eq(load(p), '}');
+        if (close != 0)
+            return p + __builtin_ctz(close);
+        p += MILA_SIMD_WIDTH;
+    }
+    return scalar::findCommentEnd(p, end);
+}
+
+inline char const * findIdentifierEnd(char const * p, char const * end) {
+    while (end - p >= MILA_SIMD_WIDTH) {
+        Vector v = load(p);
+        uint32_t other = ~(range(v, '0', '9') | range(v, 'a', 'z') | range(v, 'A', 'Z')) & FULL;
+        if (other != 0)
+            return p + __builtin_ctz(other);
+        p += MILA_SIMD_WIDTH;
+    }
+    return scalar::findIdentifierEnd(p, end);
+}
+
+inline char const * findNumberEnd(char const * p, char const * end) {
+    while (end - p >= MILA_SIMD_WIDTH) {
+        uint32_t other = ~range(load(p), '0', '9') & FULL;
+        if (other != 0)
+            return p + __builtin_ctz(other);
+        p += MILA_SIMD_WIDTH;
+    }
+    return scalar::findNumberEnd(p, end);
+}
+
+} // namespace mila::simd::vector
+
+using vector::skipWhitespace;
+using vector::findCommentEnd;
+using vector::findIdentifierEnd;
+using vector::findNumberEnd;
+
+#else
+
+using scalar::skipWhitespace;
+using scalar::findCommentEnd;
+using scalar::findIdentifierEnd;
+using scalar::findNumberEnd;
+
+#endif
+
+}
+}
+
+#endif
@@ -0,0 +1,400 @@
+#ifndef MILA_SIMPLIFIER_H
+#define MILA_SIMPLIFIER_H
+
+#include <climits>
+
+#include "ast.h"
+
+namespace mila {
+namespace ast {
+
+/** Simplifies the expressions of the AST before code generation.
+
+    Operators on numbers are folded, constants are replaced by their values and the identities x + 0, 0 + x, x - 0, x * 1, 1 * x, x / 1, x * 0, 0 * x, - - x and + x are applied. An expression is only dropped if it is pure, i.e. it has no calls, no divisions that might trap and no undeclared variables, so that the simplified program behaves and fails to compile exactly as the original one. Division by zero and the overflowing division are never folded.
+
+    Children are replaced in place, new numbers are allocated in the arena of the module. The tree is walked on an explicit stack, simplified expressions are passed to their parents on the values stack together with their sizes, from which the number of removed nodes is counted.
+
+    Strength reduction of multiplication by power of two into shift cannot be expressed in the AST, the module is marked as simplified and CodeGen::emitBinary does it when compiling it. Modules that were not simplified are compiled unchanged.
+ */
+class Simplifier : public IterativeVisitor {
+public:
+    /** Simplifies the module and returns the number of nodes removed from it.
+     */
+    static size_t simplify(Module * m) {
+        Simplifier s(m->context);
+        s.traverse(m);
+        m->simplified = true;
+        return s.removed_;
+    }
+
+protected:
+
+    Simplifier(Context & context):
+        context_(context),
+        bindings_(context.symbols.size()),
+        removed_(0) {
+    }
+
+    void visit(Node * n) override {
+    }
+
+    void visit(Module * m) override {
+        if (step() == 0) {
+            openScope();
+            declare(m->declarations);
+            push(m, 1);
+            push(m->body);
+            push(m->functions);
+        } else {
+            closeScope();
+        }
+    }
+
+    void visit(Functions * fs) override {
+        for (size_t i = fs->functions.size(); i > 0; --i)
+            push(fs->functions[i - 1]);
+    }
+
+    void visit(Function * f) override {
+        if (step() == 0) {
+            openScope();
+            for (Symbol a : f->arguments)
+                declare(a, nullptr);
+            push(f, 1);
+            push(f->body);
+        } else {
+            f->body = statement(f->body);
+            closeScope();
+        }
+    }
+
+    /** Step i simplifies the i-th statement.
+     */
+    void visit(Block * b) override {
+        size_t i = step();
+        if (i == 0) {
+            openScope();
+            declare(b->declarations);
+        } else {
+            b->statements[i - 1] = statement(b->statements[i - 1]);
+        }
+        if (i < b->statements.size()) {
+            push(b, i + 1);
+            push(b->statements[i]);
+        } else {
+            closeScope();
+        }
+    }
+
+    void visit(Write * w) override {
+        if (step() == 0) {
+            push(w, 1);
+            push(w->expression);
+        } else {
+            w->expression = pop().expression;
+        }
+    }
+
+    void visit(If * s) override {
+        switch (step()) {
+            case 0:
+                push(s, 1);
+                push(s->condition);
+                break;
+            case 1:
+                s->condition = pop().expression;
+                push(s, 2);
+                push(s->trueCase);
+                break;
+            case 2:
+                s->trueCase = statement(s->trueCase);
+                if (s->falseCase != nullptr) {
+                    push(s, 3);
+                    push(s->falseCase);
+                }
+                break;
+            default:
+                s->falseCase = statement(s->falseCase);
+        }
+    }
+
+    void visit(While * s) override {
+        switch (step()) {
+            case 0:
+                push(s, 1);
+                push(s->condition);
+                break;
+            case 1:
+                s->condition = pop().expression;
+                push(s, 2);
+                push(s->body);
+                break;
+            default:
+                s->body = statement(s->body);
+        }
+    }
+
+    void visit(Return * r) override {
+        if (r->value == nullptr)
+            return;
+        if (step() == 0) {
+            push(r, 1);
+            push(r->value);
+        } else {
+            r->value = pop().expression;
+        }
+    }
+
+    void visit(Assignment * a) override {
+        if (step() == 0) {
+            push(a, 1);
+            push(a->value);
+        } else {
+            a->value = pop().expression;
+        }
+    }
+
+    /** Step i simplifies the i-th argument.
+     */
+    void visit(Call * c) override {
+        size_t i = step();
+        if (i > 0)
+            c->arguments[i - 1] = pop().expression;
+        if (i < c->arguments.size()) {
+            push(c, i + 1);
+            push(c->arguments[i]);
+        } else {
+            // calls are never dropped, so their size does not matter
+            values_.push_back(Value{c, 1, false});
+        }
+    }
+
+    void visit(Binary * b) override {
+        if (step() == 0) {
+            push(b, 1);
+            push(b->rhs);
+            push(b->lhs);
+        } else {
+            Value rhs = pop();
+            Value lhs = pop();
+            b->lhs = lhs.expression;
+            b->rhs = rhs.expression;
+            result(binary(b, lhs, rhs), 1 + lhs.size + rhs.size);
+        }
+    }
+
+    void visit(Unary * u) override {
+        if (step() == 0) {
+            push(u, 1);
+            push(u->operand);
+        } else {
+            Value x = pop();
+            u->operand = x.expression;
+            result(unary(u, x), 1 + x.size);
+        }
+    }
+
+    void visit(Variable * v) override {
+        std::vector<Number *> const & b = bindings_[v->symbol.id()];
+        if (not b.empty() and b.back() != nullptr)
+            values_.push_back(Value{number(b.back()->value, v->offset), 1, true});
+        else
+            values_.push_back(Value{v, 1, not b.empty()});
+    }
+
+    void visit(Number * n) override {
+        values_.push_back(Value{n, 1, true});
+    }
+
+private:
+
+    /** Simplified expression with the number of its nodes, pure expressions can be dropped without changing the behavior of the program.
+     */
+    struct Value {
+        Expression * expression;
+        size_t size;
+        bool pure;
+    };
+
+    Value pop() {
+        Value result = values_.back();
+        values_.pop_back();
+        return result;
+    }
+
+    /** Returns the simplified statement, which replaces the given one.
+
+        A statement can be an expression, whose value is then on the values stack and must be taken from it, or it would be taken by the parent instead of the parent's own operand. The expression is kept even if it is pure, as the last one may be the implicit result of its function.
+     */
+    Node * statement(Node * n) {
+        switch (n->kind) {
+            case Kind::Call:
+            case Kind::Binary:
+            case Kind::Unary:
+            case Kind::Variable:
+            case Kind::Number:
+                return pop().expression;
+            default:
+                return n;
+        }
+    }
+
+    /** Pushes the simplified expression that replaces an expression of the given size.
+     */
+    void result(Value const & v, size_t size) {
+        removed_ += size - v.size;
+        values_.push_back(v);
+    }
+
+    Value binary(Binary * b, Value const & lhs, Value const & rhs) {
+        int x, y;
+        bool cx = isNumber(lhs, x);
+        bool cy = isNumber(rhs, y);
+        int folded;
+        if (cx and cy and fold(b->type, x, y, folded))
+            return Value{number(folded, b->offset), 1, true};
+        switch (b->type) {
+            case Token::Type::opAdd:
+                if (cy and y == 0)
+                    return lhs;
+                if (cx and x == 0)
+                    return rhs;
+                break;
+            case Token::Type::opSub:
+                if (cy and y == 0)
+                    return lhs;
+                break;
+            case Token::Type::opMul:
+                if (cy and y == 1)
+                    return lhs;
+                if (cx and x == 1)
+                    return rhs;
+                if (cy and y == 0 and lhs.pure)
+                    return rhs;
+                if (cx and x == 0 and rhs.pure)
+                    return lhs;
+                break;
+            case Token::Type::opDiv:
+                if (cy and y == 1)
+                    return lhs;
+                // only division by a number other than 0 and -1 cannot trap
+                return Value{b, 1 + lhs.size + rhs.size, lhs.pure and cy and y != 0 and y != -1};
+            default:
+                break;
+        }
+        return Value{b, 1 + lhs.size + rhs.size, lhs.pure and rhs.pure};
+    }
+
+    Value unary(Unary * u, Value const & x) {
+        if (u->type == Token::Type::opAdd)
+            return x;
+        int value;
+        if (isNumber(x, value))
+            return Value{number(static_cast<int>(0u - static_cast<uint32_t>(value)), u->offset), 1, true};
+        if (x.expression->kind == Kind::Unary and static_cast<Unary *>(x.expression)->type == Token::Type::opSub) {
+            Expression * operand = static_cast<Unary *>(x.expression)->operand;
+            return Value{operand, x.size - 1, x.pure};
+        }
+        return Value{u, 1 + x.size, x.pure};
+    }
+
+    /** Computes the binary operator on numbers with the semantics of the generated code, i.e. wrapping arithmetic and -1 for true. Returns false if the operation cannot be folded.
+     */
+    static bool fold(Token::Type type, int x, int y, int & result) {
+        uint32_t ux = static_cast<uint32_t>(x);
+        uint32_t uy = static_cast<uint32_t>(y);
+        switch (type) {
+            case Token::Type::opAdd:
+                result = static_cast<int>(ux + uy);
+                return true;
+            case Token::Type::opSub:
+                result = static_cast<int>(ux - uy);
+                return true;
+            case Token::Type::opMul:
+                result = static_cast<int>(ux * uy);
+                return true;
+            case Token::Type::opDiv:
+                if (y == 0 or (x == INT_MIN and y == -1))
+                    return false;
+                result = x / y;
+                return true;
+            case Token::Type::opEq:
+                result = x == y ? -1 : 0;
+                return true;
+            case Token::Type::opNeq:
+                result = x != y ? -1 : 0;
+                return true;
+            case Token::Type::opLt:
+                result = x < y ? -1 : 0;
+                return true;
+            case Token::Type::opGt:
+                result = x > y ? -1 : 0;
+                return true;
+            case Token::Type::opLte:
+                result = x <= y ? -1 : 0;
+                return true;
+            case Token::Type::opGte:
+                result = x >= y ? -1 : 0;
+                return true;
+            default:
+                return false;
+        }
+    }
+
+    static bool isNumber(Value const & v, int & value) {
+        if (v.expression->kind != Kind::Number)
+            return false;
+        value = static_cast<Number *>(v.expression)->value;
+        return true;
+    }
+
+    Number * number(int value, uint32_t offset) {
+        return new (context_.nodes) Number(Token::number(context_, value, offset));
+    }
+
+    void openScope() {
+        scopes_.push_back(declared_.size());
+    }
+
+    void closeScope() {
+        for (size_t i = scopes_.back(), e = declared_.size(); i != e; ++i)
+            bindings_[declared_[i]].pop_back();
+        declared_.resize(scopes_.back());
+        scopes_.pop_back();
+    }
+
+    /** Declares the symbol in the current scope, value is the number of a constant, or nullptr for variables.
+     */
+    void declare(Symbol symbol, Number * value) {
+        bindings_[symbol.id()].push_back(value);
+        declared_.push_back(symbol.id());
+    }
+
+    void declare(Declarations * ds) {
+        for (Declaration * d : ds->declarations)
+            declare(d->symbol, d->value);
+    }
+
+    Context & context_;
+
+    std::vector<Value> values_;
+
+    /** Declarations of each symbol id, the innermost last.
+     */
+    std::vector<std::vector<Number *>> bindings_;
+
+    /** Ids of the symbols declared in all open scopes, in order.
+     */
+    std::vector<int> declared_;
+
+    /** Start of each open scope in declared_.
+     */
+    std::vector<size_t> scopes_;
+
+    size_t removed_;
+};
+
+}
+}
+
+#endif
@@ -0,0 +1,171 @@
+#ifndef MILA_SOURCE_H
+#define MILA_SOURCE_H
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "mila.h"
+
+namespace mila {
+
+/** Read-only memory mapping of a source file.
+
+    The scanner lexes straight from the mapped bytes so that no copy of the file and no per-token strings are ever made. The mapping is released when the object is destroyed, the object can be moved, but not copied.
+ */
+class MappedFile {
+public:
+    static MappedFile open(std::string const & filename) {
+        int fd = ::open(filename.c_str(), O_RDONLY);
+        if (fd < 0)
+            throw Exception(STR("Unable to open file " << filename));
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            ::close(fd);
+            throw Exception(STR("Unable to stat file " << filename));
+        }
+        MappedFile result;
+        result.size_ = st.st_size;
+        // empty files cannot be mapped, they are represented by empty buffer
+        if (result.size_ > 0) {
+            void * data = mmap(nullptr, result.size_, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (data == MAP_FAILED) {
+                ::close(fd);
+                throw Exception(STR("Unable to map file " << filename));
+            }
+            madvise(data, result.size_, MADV_SEQUENTIAL);
+            result.data_ = static_cast<char const *>(data);
+        }
+        ::close(fd);
+        return result;
+    }
+
+    MappedFile():
+        data_(nullptr),
+        size_(0) {
+    }
+
+    MappedFile(MappedFile && other):
+        data_(other.data_),
+        size_(other.size_) {
+        other.data_ = nullptr;
+        other.size_ = 0;
+    }
+
+    MappedFile & operator = (MappedFile && other) {
+        if (this != &other) {
+            unmap();
+            data_ = other.data_;
+            size_ = other.size_;
+            other.data_ = nullptr;
+            other.size_ = 0;
+        }
+        return *this;
+    }
+
+    MappedFile(MappedFile const &) = delete;
+
+    MappedFile & operator = (MappedFile const &) = delete;
+
+    ~MappedFile() {
+        unmap();
+    }
+
+    char const * begin() const {
+        return data_;
+    }
+
+    char const * end() const {
+        return data_ + size_;
+    }
+
+    size_t size() const {
+        return size_;
+    }
+
+private:
+
+    void unmap() {
+        if (data_ != nullptr)
+            munmap(const_cast<char *>(data_), size_);
+    }
+
+    char const * data_;
+    size_t size_;
+};
+
+/** Maps source offsets to lines and columns.
+
+    Tokens and AST nodes only remember their offset in the source. Lines and columns are needed only for error messages, so the offsets of all newlines are found the first time a location is asked for. Sources that are not kept in memory (streams) record their newlines as they are read instead.
+ */
+class LineTable {
+public:
+    LineTable():
+        begin_(nullptr),
+        end_(nullptr),
+        built_(true) {
+    }
+
+    /** Newlines of the given buffer will be found when first needed.
+     */
+    void reset(char const * begin, char const * end) {
+        begin_ = begin;
+        end_ = end;
+        newlines_.clear();
+        built_ = false;
+    }
+
+    /** Newlines will be added as the source is read.
+     */
+    void reset() {
+        begin_ = nullptr;
+        end_ = nullptr;
+        newlines_.clear();
+        built_ = true;
+    }
+
+    void addNewline(uint32_t offset) {
+        newlines_.push_back(offset);
+    }
+
+    /** Returns the line and column (both starting at 1) of the given offset.
+     */
+    void resolve(uint32_t offset, int & line, int & col) {
+        build();
+        size_t before = std::lower_bound(newlines_.begin(), newlines_.end(), offset) - newlines_.begin();
+        line = before + 1;
+        col = before == 0 ? offset + 1 : offset - newlines_[before - 1];
+    }
+
+    /** Finds the newlines now, after which the table is only read and can be used by multiple threads.
+     */
+    void build() {
+        if (built_)
+            return;
+        for (char const * i = begin_; i != end_; ++i) {
+            i = static_cast<char const *>(memchr(i, '\n', end_ - i));
+            if (i == nullptr)
+                break;
+            newlines_.push_back(i - begin_);
+        }
+        built_ = true;
+    }
+
+private:
+
+    char const * begin_;
+    char const * end_;
+    bool built_;
+    std::vector<uint32_t> newlines_;
+};
+
+}
+
+#endif
@@ -0,0 +1,149 @@
+#ifndef MILA_SYMBOLTABLE_H
+#define MILA_SYMBOLTABLE_H
+
+#include <cstdint>
+#include <cstring>
+
+#include <memory>
+#include <vector>
+
+namespace mila {
+
+/** Bump allocator for the interned strings.
+
+    Strings are copied into large chunks and are never freed individually, pointers to them stay valid for the lifetime of the arena.
+ */
+class StringArena {
+public:
+    StringArena():
+        pos_(nullptr),
+        remaining_(0),
+        bytes_(0) {
+    }
+
+    /** Copies the string into the arena and zero terminates it.
+     */
+    char const * store(char const * str, size_t length) {
+        size_t size = length + 1;
+        if (size > remaining_) {
+            size_t chunk = CHUNK_SIZE;
+            if (size > chunk)
+                chunk = size;
+            chunks_.push_back(std::unique_ptr<char[]>(new char[chunk]));
+            pos_ = chunks_.back().get();
+            remaining_ = chunk;
+        }
+        char * result = pos_;
+        memcpy(result, str, length);
+        result[length] = 0;
+        pos_ += size;
+        remaining_ -= size;
+        bytes_ += size;
+        return result;
+    }
+
+    /** Number of bytes stored in the arena.
+     */
+    size_t bytes() const {
+        return bytes_;
+    }
+
+private:
+    static constexpr size_t CHUNK_SIZE = 64 * 1024;
+
+    std::vector<std::unique_ptr<char[]>> chunks_;
+    char * pos_;
+    size_t remaining_;
+    size_t bytes_;
+};
+
+/** Bidirectional string interner.
+
+    Strings are mapped to dense integer ids using an open addressing hash table, the names themselves are kept in an arena and the id to name lookup is a simple index to a vector.
+ */
+class SymbolTable {
+public:
+    SymbolTable():
+        buckets_(INITIAL_BUCKETS, int(EMPTY)) {
+    }
+
+    /** Returns the id of the given string, creating a new one if the string has not been seen yet.
+     */
+    int intern(char const * name, size_t length) {
+        uint32_t h = hash(name, length);
+        size_t mask = buckets_.size() - 1;
+        size_t i = h & mask;
+        while (buckets_[i] != EMPTY) {
+            Entry const & e = entries_[buckets_[i]];
+            if (e.hash == h and e.length == length and memcmp(e.name, name, length) == 0)
+                return buckets_[i];
+            i = (i + 1) & mask;
+        }
+        int id = entries_.size();
+        entries_.push_back(Entry{arena_.store(name, length), static_cast<uint32_t>(length), h});
+        buckets_[i] = id;
+        // keep the load factor below 1/2
+        if (entries_.size() * 2 > buckets_.size())
+            rehash();
+        return id;
+    }
+
+    char const * name(int id) const {
+        return entries_[id].name;
+    }
+
+    size_t length(int id) const {
+        return entries_[id].length;
+    }
+
+    /** Number of interned strings.
+     */
+    size_t size() const {
+        return entries_.size();
+    }
+
+    /** Bytes used by the interned strings, including their terminating zeros.
+     */
+    size_t bytes() const {
+        return arena_.bytes();
+    }
+
+private:
+
+    struct Entry {
+        char const * name;
+        uint32_t length;
+        uint32_t hash;
+    };
+
+    /** FNV-1a.
+     */
+    static uint32_t hash(char const * str, size_t length) {
+        uint32_t result = 2166136261u;
+        for (size_t i = 0; i < length; ++i)
+            result = (result ^ static_cast<unsigned char>(str[i])) * 16777619u;
+        return result;
+    }
+
+    void rehash() {
+        buckets_.assign(buckets_.size() * 2, int(EMPTY));
+        size_t mask = buckets_.size() - 1;
+        for (size_t id = 0, e = entries_.size(); id != e; ++id) {
+            size_t i = entries_[id].hash & mask;
+            while (buckets_[i] != EMPTY)
+                i = (i + 1) & mask;
+            buckets_[i] = id;
+        }
+    }
+
+    static constexpr int EMPTY = -1;
+    static constexpr size_t INITIAL_BUCKETS = 256;
+
+    std::vector<Entry> entries_;
+    std::vector<int> buckets_;
+    StringArena arena_;
+};
+
+}
+
+#endif
@@ -0,0 +1,135 @@
+#ifndef MILA_THREADPOOL_H
+#define MILA_THREADPOOL_H
+
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace mila {
+
+/** Fixed size pool of worker threads.
+
+    Work is submitted in batches of independent jobs by parallelFor(), which blocks until the whole batch is done. The pool itself holds no compilation state, a single pool can be shared by any number of compilations, each with its own context.
+ */
+class ThreadPool {
+public:
+    /** Creates the pool with the given number of workers, or one per hardware thread if zero.
+     */
+    explicit ThreadPool(unsigned threads = 0):
+        stop_(false) {
+        if (threads == 0)
+            threads = std::thread::hardware_concurrency();
+        if (threads == 0)
+            threads = 1;
+        for (unsigned i = 0; i < threads; ++i)
+            workers_.push_back(std::thread([this] () { work(); }));
+    }
+
+    ThreadPool(ThreadPool const &) = delete;
+
+    ThreadPool & operator = (ThreadPool const &) = delete;
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> g(m_);
+            stop_ = true;
+        }
+        cv_.notify_all();
+        for (std::thread & t : workers_)
+            t.join();
+    }
+
+    /** Number of worker threads.
+     */
+    size_t size() const {
+        return workers_.size();
+    }
+
+    /** Calls f(i) for all i in [0, n) on the workers and waits for all of them to finish.
+
+        If any of the calls throws, the exception of the lowest i is rethrown once the batch is finished, so that errors are reported as if the jobs ran in order. Must not be called from a job of the same pool.
+     */
+    template<typename F>
+    void parallelFor(size_t n, F f) {
+        if (n == 0)
+            return;
+        Batch batch(n);
+        Batch * b = &batch;
+        {
+            std::lock_guard<std::mutex> g(m_);
+            for (size_t i = 0; i < n; ++i)
+                jobs_.push_back([b, i, &f] () {
+                    try {
+                        f(i);
+                    } catch (...) {
+                        b->errors[i] = std::current_exception();
+                    }
+                    b->done();
+                });
+        }
+        cv_.notify_all();
+        batch.wait();
+        for (std::exception_ptr const & e : batch.errors)
+            if (e)
+                std::rethrow_exception(e);
+    }
+
+private:
+
+    /** Completion counter of a single parallelFor() call.
+
+        The counter is notified while its lock is held, so that the waiting thread cannot destroy it before the last job is done with it.
+     */
+    class Batch {
+    public:
+        Batch(size_t n):
+            remaining(n),
+            errors(n) {
+        }
+
+        void done() {
+            std::lock_guard<std::mutex> g(m);
+            if (--remaining == 0)
+                cv.notify_all();
+        }
+
+        void wait() {
+            std::unique_lock<std::mutex> g(m);
+            cv.wait(g, [this] () { return remaining == 0; });
+        }
+
+        std::mutex m;
+        std::condition_variable cv;
+        size_t remaining;
+        std::vector<std::exception_ptr> errors;
+    };
+
+    void work() {
+        while (true) {
+            std::function<void()> job;
+            {
+                std::unique_lock<std::mutex> g(m_);
+                cv_.wait(g, [this] () { return stop_ or not jobs_.empty(); });
+                if (jobs_.empty())
+                    return;
+                job = std::move(jobs_.front());
+                jobs_.pop_front();
+            }
+            job();
+        }
+    }
+
+    std::vector<std::thread> workers_;
+    std::deque<std::function<void()>> jobs_;
+    std::mutex m_;
+    std::condition_variable cv_;
+    bool stop_;
+};
+
+}
+
+#endif
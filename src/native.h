@@ -0,0 +1,98 @@
+#ifndef NATIVE_H
+#define NATIVE_H
+
+#include <cstdio>
+#include <string>
+
+#include "llvm.h"
+
+#include "compiler.h"
+
+#ifndef MILA_RUNTIME
+#define MILA_RUNTIME "libmila-runtime.a"
+#endif
+
+namespace mila {
+
+/** Ahead of time compilation of the module to native object files and standalone executables.
+
+    The module is lowered by the target machine of the host into an object file, which is then linked by the system C++ compiler (found on the PATH and executed without a shell) with the static runtime library (built from runtime.cpp by cmake). The runtime provides the C main function, which calls the compiled main and prints its result, just like the JIT does, so that the executable behaves the same as mila+ running the program.
+ */
+class Native {
+public:
+
+    /** Writes the module as native object file of the host to the given stream.
+
+        The implicit main function is renamed to mila_main, which cannot clash with the user functions as mila identifiers have no underscores.
+     */
+    static void object(llvm::Module * m, llvm::raw_pwrite_stream & o) {
+        std::unique_ptr<llvm::TargetMachine> tm(targetMachine());
+        m->setTargetTriple(tm->getTargetTriple().str());
+        m->setDataLayout(tm->createDataLayout());
+        if (llvm::Function * main = m->getFunction("main"))
+            main->setName(ENTRY);
+        llvm::legacy::PassManager pm;
+        if (tm->addPassesToEmitFile(pm, o, llvm::TargetMachine::CGFT_ObjectFile))
+            throw CompilerError("Target machine cannot emit object files");
+        pm.run(*m);
+    }
+
+    /** Writes the module as native object file of the host to the given file.
+     */
+    static void object(llvm::Module * m, std::string const & filename) {
+        std::error_code error;
+        llvm::raw_fd_ostream o(filename, error, llvm::sys::fs::OpenFlags::F_None);
+        if (error)
+            throw Exception(STR("Unable to open " << filename << ": " << error.message()));
+        object(m, o);
+    }
+
+    /** Compiles the module into standalone executable linked with the given static runtime library.
+     */
+    static void executable(llvm::Module * m, std::string const & filename, std::string const & runtime = MILA_RUNTIME) {
+        std::string obj = filename + ".o";
+        object(m, obj);
+        llvm::ErrorOr<std::string> linker = llvm::sys::findProgramByName(LINKER);
+        if (not linker) {
+            std::remove(obj.c_str());
+            throw Exception(STR("Unable to find " << LINKER << ": " << linker.getError().message()));
+        }
+        // the linker is executed directly, not by the shell, so the filenames are passed as they are
+        char const * args[] = { LINKER, "-o", filename.c_str(), obj.c_str(), runtime.c_str(), nullptr };
+        std::string err;
+        int status = llvm::sys::ExecuteAndWait(linker.get(), args, nullptr, nullptr, 0, 0, &err);
+        std::remove(obj.c_str());
+        if (status != 0) {
+            if (err.empty())
+                err = STR(LINKER << " exited with status " << status);
+            throw Exception(STR("Unable to link " << filename << " with runtime " << runtime << ": " << err));
+        }
+    }
+
+    /** The name of the compiled main function called by the runtime.
+     */
+    static constexpr char const * ENTRY = "mila_main";
+
+private:
+
+    static llvm::TargetMachine * targetMachine() {
+        std::string triple = llvm::sys::getDefaultTargetTriple();
+        std::string err;
+        llvm::Target const * target = llvm::TargetRegistry::lookupTarget(triple, err);
+        if (target == nullptr)
+            throw CompilerError(STR("Unable to find target " << triple << ": " << err));
+        llvm::TargetOptions opts;
+        // position independent so that the system compiler can link it into PIE executable
+        llvm::TargetMachine * tm = target->createTargetMachine(triple, llvm::sys::getHostCPUName(), "", opts, llvm::Optional<llvm::Reloc::Model>(llvm::Reloc::PIC_));
+        if (tm == nullptr)
+            throw CompilerError(STR("Unable to create target machine for " << triple));
+        return tm;
+    }
+
+    static constexpr char const * LINKER = "c++";
+
+};
+
+}
+
+#endif
@@ -0,0 +1,98 @@
+#ifndef OPTIMIZER_H
+#define OPTIMIZER_H
+
+#include <string>
+#include <vector>
+
+#include "llvm.h"
+
+#include "compiler.h"
+
+namespace mila {
+
+/** Optimizes the compiled module in process, instead of writing bitcode for separate opt runs.
+
+    The standard pipeline of the given level (-O0 to -O3, as built by opt) runs first, followed by the passes given by name, which may come from plugins such as the passes/ library loaded with load().
+ */
+class Optimizer {
+public:
+
+    /** Loads a library of passes, its passes register themselves in the pass registry when it is loaded.
+     */
+    static void load(std::string const & filename) {
+        std::string err;
+        if (llvm::sys::DynamicLibrary::LoadLibraryPermanently(filename.c_str(), &err))
+            throw Exception(STR("Unable to load passes from " << filename << ": " << err));
+    }
+
+    /** Splits comma separated list of pass names, each optionally with the leading dash of opt.
+     */
+    static std::vector<std::string> passes(std::string const & list) {
+        std::vector<std::string> result;
+        size_t start = 0;
+        while (start < list.size()) {
+            size_t end = list.find(',', start);
+            if (end == std::string::npos)
+                end = list.size();
+            std::string name = list.substr(start, end - start);
+            if (not name.empty() and name[0] == '-')
+                name.erase(0, 1);
+            if (not name.empty())
+                result.push_back(name);
+            start = end + 1;
+        }
+        return result;
+    }
+
+    /** Runs the pipeline of the given level and then the given passes on the module.
+     */
+    static void run(llvm::Module * m, unsigned level, std::vector<std::string> const & passes) {
+        initialize();
+        llvm::legacy::FunctionPassManager fpm(m);
+        llvm::legacy::PassManager mpm;
+        llvm::PassManagerBuilder builder;
+        builder.OptLevel = level;
+        if (level > 1)
+            builder.Inliner = llvm::createFunctionInliningPass(level, 0, false);
+        builder.populateFunctionPassManager(fpm);
+        builder.populateModulePassManager(mpm);
+        for (std::string const & name : passes) {
+            llvm::PassInfo const * info = llvm::PassRegistry::getPassRegistry()->getPassInfo(name);
+            if (info == nullptr or info->getNormalCtor() == nullptr)
+                throw Exception(STR("Unknown pass " << name));
+            mpm.add(info->createPass());
+        }
+        fpm.doInitialization();
+        for (llvm::Function & f : *m)
+            fpm.run(f);
+        fpm.doFinalization();
+        mpm.run(*m);
+        // check that the passes left the module well formed
+        llvm::raw_os_ostream err(std::cerr);
+        if (llvm::verifyModule(*m, & err))
+            throw CompilerError("Invalid LLVM bitcode after optimization");
+    }
+
+private:
+
+    /** Registers the passes linked into mila+, so that they can be found by name.
+     */
+    static void initialize() {
+        static bool initialized = false;
+        if (initialized)
+            return;
+        llvm::PassRegistry & r = *llvm::PassRegistry::getPassRegistry();
+        llvm::initializeCore(r);
+        llvm::initializeAnalysis(r);
+        llvm::initializeTransformUtils(r);
+        llvm::initializeScalarOpts(r);
+        llvm::initializeInstCombine(r);
+        llvm::initializeIPO(r);
+        llvm::initializeVectorization(r);
+        initialized = true;
+    }
+};
+
+}
+
+#endif
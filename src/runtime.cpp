@@ -1,3 +1,4 @@
+#include <cstdlib>
 #include <iostream>
 
 #include "mila.h"
@@ -13,3 +14,14 @@ extern "C" int read_() {
 extern "C" void write_(int what) {
     std::cout << "Vypis: " << what << std::endl;
 }
+
+#ifdef MILA_STANDALONE
+/* the static runtime of the executables compiled ahead of time calls their main and prints its result like the JIT does */
+
+extern "C" int mila_main();
+
+int main() {
+    std::cout << mila_main() << std::endl;
+    return EXIT_SUCCESS;
+}
+#endif